@@ -0,0 +1,273 @@
+/*
+ * HEADLESS RENDERING BENCHMARK
+ *
+ * Renders a range of pages of a document with the backend it is linked
+ * with, at each of the given zooms and rotations, and copies them into
+ * a framebuffer kept in memory.  For each zoom and rotation it reports
+ * the percentiles of the time to render a page, the rendered pixels per
+ * second, the number of memory allocations and the peak resident set
+ * size of the process, as CSV or JSON.  No framebuffer is needed.
+ *
+ *   usage: fbpdf-bench [-p first-last] [-z zoom_x10,...] [-r rotation,...]
+ *          [-t threads] [-l lists_MB] [-n rounds] [-s WxH] [-m mode]
+ *          [-j] [-M] [-g] file
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "draw.h"
+#include "doc.h"
+
+#define LEN(a)		(sizeof(a) / sizeof((a)[0]))
+#define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define NCONF		16		/* the maximum number of zooms or rotations */
+
+static struct {
+	char *name;
+	unsigned mode;		/* as returned by fb_mode() */
+} modes[] = {
+	{"xrgb8888", (4 << 16) | (8 << 8) | (8 << 4) | 8},
+	{"xbgr8888", (7 << 20) | (4 << 16) | (8 << 8) | (8 << 4) | 8},
+	{"bgr888", (7 << 20) | (3 << 16) | (8 << 8) | (8 << 4) | 8},
+	{"rgb565", (2 << 16) | (5 << 8) | (6 << 4) | 5},
+};
+
+/* allocations are counted by wrapping those of the C library */
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+static long nallocs;
+
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	__atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&nallocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* peak resident set size in kilobytes */
+static long peakrss(void)
+{
+	struct rusage ru;
+	return getrusage(RUSAGE_SELF, &ru) ? 0 : ru.ru_maxrss;
+}
+
+static int dblcmp(const void *v1, const void *v2)
+{
+	double d1 = *(double *) v1;
+	double d2 = *(double *) v2;
+	return d1 < d2 ? -1 : d1 > d2;
+}
+
+/* the p-th percentile of n sorted values (nearest rank) */
+static double pct(double *v, int n, int p)
+{
+	int i = (n * p + 99) / 100 - 1;
+	return n ? v[i < 0 ? 0 : i] : 0;
+}
+
+/* parse a comma separated list of integers multiplied by mul */
+static int numlist(char *s, int *v, int mul)
+{
+	int n = 0;
+	while (*s && n < NCONF) {
+		v[n++] = atoi(s) * mul;
+		while (*s && *s != ',')
+			s++;
+		if (*s)
+			s++;
+	}
+	return n;
+}
+
+/* copy the top-left part of the page to the screen, as fbpdf would */
+static void blit(char *scr, int srows, int scols, char *pbuf, int rows, int cols,
+		int bpp, int gray)
+{
+	int i;
+	for (i = 0; i < MIN(rows, srows); i++)
+		if (gray)
+			fb_gray(scr + i * scols * bpp, pbuf + i * cols, MIN(cols, scols));
+		else
+			memcpy(scr + i * scols * bpp, pbuf + i * cols * bpp,
+				MIN(cols, scols) * bpp);
+}
+
+static char *usage =
+	"usage: fbpdf-bench [-p first-last] [-z zoom_x10,...] [-r rotation,...] [-t threads] "
+	"[-l lists MB] [-n rounds] [-s WxH] [-m mode] [-j] [-M] [-g] file";
+
+int main(int argc, char *argv[])
+{
+	int zooms[NCONF] = {150}, rots[NCONF] = {0};
+	int nzooms = 1, nrots = 1;
+	int first = 1, last = 0;
+	int rounds = 1;
+	int srows = 1080, scols = 1920;
+	int json = 0;
+	int gray = 0;
+	unsigned mode = modes[0].mode;
+	char *backend = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+	char *path;
+	struct doc *doc;
+	char *scr;
+	double *lat;
+	double t;
+	int z, r, p, i, j;
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		int c = argv[i][1];
+		char *arg = NULL;
+		if (c && strchr("pzrtlnsm", c))
+			if (!(arg = argv[i][2] ? argv[i] + 2 : argv[++i]))
+				break;
+		switch (c) {
+		case 'p':
+			first = atoi(arg);
+			last = strchr(arg, '-') ? atoi(strchr(arg, '-') + 1) : first;
+			break;
+		case 'z':
+			nzooms = numlist(arg, zooms, 10);
+			break;
+		case 'r':
+			nrots = numlist(arg, rots, 1);
+			break;
+		case 't':
+			doc_threads(atoi(arg));
+			break;
+		case 'l':
+			doc_cache(atol(arg) << 20);
+			break;
+		case 'n':
+			rounds = atoi(arg);
+			break;
+		case 's':
+			scols = atoi(arg);
+			srows = strchr(arg, 'x') ? atoi(strchr(arg, 'x') + 1) : scols;
+			break;
+		case 'm':
+			for (j = 0; j < LEN(modes) && strcmp(modes[j].name, arg); j++)
+				;
+			if (j == LEN(modes)) {
+				fprintf(stderr, "fbpdf-bench: unknown mode %s\n", arg);
+				return 1;
+			}
+			mode = modes[j].mode;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'M':
+			doc_preload(1);
+			break;
+		case 'g':
+			gray = 1;
+			doc_gray(1);
+			break;
+		}
+	}
+	if (i != argc - 1 || !nzooms || !nrots || rounds < 1 || srows < 1 || scols < 1) {
+		puts(usage);
+		return 1;
+	}
+	path = argv[i];
+	/* the backends convert pixels to the format of this framebuffer */
+	fb_setmode(mode);
+	if (!(doc = doc_open(path))) {
+		fprintf(stderr, "fbpdf-bench: cannot open <%s>\n", path);
+		return 1;
+	}
+	if (!last || last > doc_pages(doc))
+		last = doc_pages(doc);
+	if (first < 1)
+		first = 1;
+	if (first > last) {
+		fprintf(stderr, "fbpdf-bench: no pages in %d-%d\n", first, last);
+		doc_close(doc);
+		return 1;
+	}
+	scr = malloc(srows * scols * FBM_BPP(mode));
+	lat = malloc((last - first + 1) * rounds * sizeof(lat[0]));
+	if (!scr || !lat) {
+		doc_close(doc);
+		return 1;
+	}
+	if (json)
+		printf("[");
+	else
+		printf("backend,file,zoom,rotate,pages,failed,p50_ms,p90_ms,p99_ms,max_ms,"
+			"mpix_per_s,allocs,peak_rss_kb\n");
+	for (z = 0; z < nzooms; z++) {
+		for (r = 0; r < nrots; r++) {
+			long allocs = nallocs;
+			double busy = 0;
+			double pixels = 0;
+			int n = 0, failed = 0;
+			for (i = 0; i < rounds; i++) {
+				for (p = first; p <= last; p++) {
+					int rows, cols;
+					char *pbuf;
+					t = now();
+					pbuf = doc_draw(doc, p, zooms[z], rots[r], &rows, &cols);
+					if (pbuf)
+						blit(scr, srows, scols, pbuf, rows, cols,
+							FBM_BPP(mode), gray);
+					t = now() - t;
+					if (!pbuf) {
+						failed++;
+						continue;
+					}
+					free(pbuf);
+					lat[n++] = t * 1000;
+					busy += t;
+					pixels += (double) rows * cols;
+				}
+			}
+			qsort(lat, n, sizeof(lat[0]), dblcmp);
+			if (json)
+				printf("%s\n {\"backend\": \"%s\", \"file\": \"%s\", "
+					"\"zoom\": %d, \"rotate\": %d, "
+					"\"pages\": %d, \"failed\": %d, "
+					"\"p50_ms\": %.2f, \"p90_ms\": %.2f, \"p99_ms\": %.2f, "
+					"\"max_ms\": %.2f, \"mpix_per_s\": %.2f, "
+					"\"allocs\": %ld, \"peak_rss_kb\": %ld}",
+					z || r ? "," : "", backend, path,
+					zooms[z], rots[r], n, failed,
+					pct(lat, n, 50), pct(lat, n, 90), pct(lat, n, 99),
+					pct(lat, n, 100), busy > 0 ? pixels / busy / 1e6 : 0,
+					nallocs - allocs, peakrss());
+			else
+				printf("%s,%s,%d,%d,%d,%d,%.2f,%.2f,%.2f,%.2f,%.2f,%ld,%ld\n",
+					backend, path, zooms[z], rots[r], n, failed,
+					pct(lat, n, 50), pct(lat, n, 90), pct(lat, n, 99),
+					pct(lat, n, 100), busy > 0 ? pixels / busy / 1e6 : 0,
+					nallocs - allocs, peakrss());
+			fflush(stdout);
+		}
+	}
+	if (json)
+		printf("\n]\n");
+	free(lat);
+	free(scr);
+	doc_close(doc);
+	return 0;
+}
@@ -0,0 +1,180 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+#include "trace.h"
+
+struct centry {
+	struct ckey key;
+	void *pbuf;		/* rendered page */
+	int rows, cols;
+	long size;		/* size of pbuf in bytes */
+	int stale;		/* rendered from an older version of the file */
+	struct centry *next;	/* the next less recently used entry */
+};
+
+static struct centry *cache;		/* the most recently used entry */
+static long cache_max = 64 << 20;	/* the maximum number of cached bytes */
+static struct cstat cstat;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* return the link pointing to the entry for key */
+static struct centry **cache_find(struct ckey *key)
+{
+	struct centry **c = &cache;
+	while (*c && memcmp(&(*c)->key, key, sizeof(*key)))
+		c = &(*c)->next;
+	return c;
+}
+
+static void cache_drop(struct centry **c)
+{
+	struct centry *e = *c;
+	*c = e->next;
+	cstat.size -= e->size;
+	free(e->pbuf);
+	free(e);
+}
+
+/* drop the least recently used entries until size more bytes fit */
+static void cache_shrink(long size)
+{
+	struct centry **c;
+	while (cache && cstat.size + size > cache_max) {
+		c = &cache;
+		while ((*c)->next)
+			c = &(*c)->next;
+		cache_drop(c);
+		cstat.evicts++;
+	}
+}
+
+/* set the maximum number of bytes held in the cache */
+void cache_limit(long size)
+{
+	pthread_mutex_lock(&cache_lock);
+	cache_max = size;
+	cache_shrink(0);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+long cache_size(void)
+{
+	return cache_max;
+}
+
+/* remove a page from the cache; the caller owns the returned buffer */
+void *cache_get(struct ckey *key, int *rows, int *cols)
+{
+	struct centry **c;
+	void *pbuf = NULL;
+	long long beg = trace_now();
+	pthread_mutex_lock(&cache_lock);
+	if (*(c = cache_find(key))) {
+		pbuf = (*c)->pbuf;
+		*rows = (*c)->rows;
+		*cols = (*c)->cols;
+		(*c)->pbuf = NULL;
+		cache_drop(c);
+		cstat.hits++;
+	} else {
+		cstat.misses++;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	trace_add(TR_CACHE, key->page, beg);
+	return pbuf;
+}
+
+int cache_has(struct ckey *key)
+{
+	int ret;
+	pthread_mutex_lock(&cache_lock);
+	ret = *cache_find(key) != NULL;
+	pthread_mutex_unlock(&cache_lock);
+	return ret;
+}
+
+/* hand a page to the cache as its most recently used entry */
+void cache_put(struct ckey *key, void *pbuf, int rows, int cols, long size)
+{
+	struct centry **c;
+	struct centry *e;
+	if (!pbuf)
+		return;
+	if (size > cache_max || !(e = malloc(sizeof(*e)))) {
+		free(pbuf);
+		return;
+	}
+	pthread_mutex_lock(&cache_lock);
+	if (*(c = cache_find(key)))
+		cache_drop(c);
+	cache_shrink(size);
+	e->key = *key;
+	e->pbuf = pbuf;
+	e->rows = rows;
+	e->cols = cols;
+	e->size = size;
+	e->stale = 0;
+	e->next = cache;
+	cache = e;
+	cstat.size += size;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/* mark page (every page if zero) as rendered from an older version of the file */
+void cache_stale(int page)
+{
+	struct centry *e;
+	pthread_mutex_lock(&cache_lock);
+	for (e = cache; e; e = e->next)
+		if (!page || e->key.page == page)
+			e->stale = 1;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/* store the cached pages that are not stale; returns their number or -1 if more than n */
+int cache_pages(int *pages, int n)
+{
+	struct centry *e;
+	int cnt = 0;
+	int i;
+	pthread_mutex_lock(&cache_lock);
+	for (e = cache; e && cnt >= 0; e = e->next) {
+		for (i = 0; i < cnt && pages[i] != e->key.page; i++)
+			;
+		if (e->stale || i < cnt)
+			continue;
+		if (cnt < n)
+			pages[cnt++] = e->key.page;
+		else
+			cnt = -1;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return cnt;
+}
+
+int cache_isstale(struct ckey *key)
+{
+	struct centry *e;
+	int ret;
+	pthread_mutex_lock(&cache_lock);
+	e = *cache_find(key);
+	ret = e && e->stale;
+	pthread_mutex_unlock(&cache_lock);
+	return ret;
+}
+
+void cache_clear(void)
+{
+	pthread_mutex_lock(&cache_lock);
+	while (cache)
+		cache_drop(&cache);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void cache_stat(struct cstat *st)
+{
+	pthread_mutex_lock(&cache_lock);
+	*st = cstat;
+	pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,39 @@
+/* rendered page cache */
+struct ckey {
+	int page;		/* page number */
+	int zoom;		/* zoom level */
+	int rotate;		/* rotation */
+	int invert;		/* inverted colors */
+	int tile;		/* tile number plus one; zero for whole pages */
+};
+
+/* cache statistics */
+struct cstat {
+	long hits;		/* successful cache_get() calls */
+	long misses;		/* failed cache_get() calls */
+	long evicts;		/* pages dropped to stay within the limit */
+	long size;		/* bytes currently cached */
+};
+
+void cache_limit(long size);
+long cache_size(void);
+void *cache_get(struct ckey *key, int *rows, int *cols);
+int cache_has(struct ckey *key);
+void cache_put(struct ckey *key, void *pbuf, int rows, int cols, long size);
+void cache_stale(int page);
+int cache_pages(int *pages, int n);
+int cache_isstale(struct ckey *key);
+void cache_clear(void);
+void cache_stat(struct cstat *st);
+
+/* on-disk cache of compressed pages (disk.c) */
+int disk_open(char *dir, char *path, unsigned mode);
+void disk_close(void);
+void disk_limit(long size);
+void *disk_get(struct ckey *key, int *rows, int *cols);
+int disk_has(struct ckey *key);
+void disk_put(struct ckey *key, void *pbuf, int rows, int cols, long size);
+int disk_file(char *path, int len, char *ext);
+int disk_lastpage(void);
+void disk_setpage(int page);
+int disk_save(char *ext, int (*save)(char *path));
@@ -0,0 +1,95 @@
+/*
+ * FB_CONV() MICRO-BENCHMARK
+ *
+ * Converts a page worth of pixels from each source layout to a few
+ * framebuffer modes, with and without the vector kernels, checks that
+ * both agree and reports the throughput in source megabytes per second.
+ * No framebuffer is needed.
+ *
+ *   usage: convbench [width height [rounds]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "draw.h"
+
+#define LEN(a)		(sizeof(a) / sizeof((a)[0]))
+
+static struct {
+	char *name;
+	unsigned mode;		/* as returned by fb_mode() */
+} modes[] = {
+	{"rgb565", (2 << 16) | (5 << 8) | (6 << 4) | 5},
+	{"xrgb8888", (4 << 16) | (8 << 8) | (8 << 4) | 8},
+	{"xbgr8888", (7 << 20) | (4 << 16) | (8 << 8) | (8 << 4) | 8},
+};
+
+static struct {
+	char *name;
+	int fmt;		/* FBFMT_* */
+	int n;			/* bytes per pixel */
+} fmts[] = {
+	{"rgb24", FBFMT_RGB24, 3},
+	{"rgbx32", FBFMT_RGBX32, 4},
+	{"bgrx32", FBFMT_BGRX32, 4},
+	{"gray8", FBFMT_GRAY8, 1},
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* convert rounds times; returns seconds */
+static double run(void *dst, unsigned char *src, int w, int h, int fmt, int n, int rounds)
+{
+	double beg = now();
+	int i, y;
+	for (i = 0; i < rounds; i++)
+		for (y = 0; y < h; y++)
+			fb_conv((char *) dst + y * w * 4, src + y * w * n, w, fmt);
+	return now() - beg;
+}
+
+int main(int argc, char *argv[])
+{
+	int w = argc > 2 ? atoi(argv[1]) : 1920;
+	int h = argc > 2 ? atoi(argv[2]) : 1080;
+	int rounds = argc > 3 ? atoi(argv[3]) : 20;
+	unsigned char *src = malloc(w * h * 4);
+	void *dst1 = malloc(w * h * 4);
+	void *dst2 = malloc(w * h * 4);
+	double t1, t2;
+	int m, f, i;
+	int ret = 0;
+	for (i = 0; i < w * h * 4; i++)
+		src[i] = rand();
+	printf("%-10s %-8s %10s %10s %8s\n", "mode", "source", "scalar", "simd", "check");
+	for (m = 0; m < LEN(modes); m++) {
+		for (f = 0; f < LEN(fmts); f++) {
+			int bpp = FBM_BPP(modes[m].mode);
+			double mb = (double) w * h * rounds * fmts[f].n / (1 << 20);
+			int ok = 1;
+			setenv("FBPDF_NOSIMD", "1", 1);
+			fb_setmode(modes[m].mode);
+			t1 = run(dst1, src, w, h, fmts[f].fmt, fmts[f].n, rounds);
+			unsetenv("FBPDF_NOSIMD");
+			fb_setmode(modes[m].mode);
+			t2 = run(dst2, src, w, h, fmts[f].fmt, fmts[f].n, rounds);
+			for (i = 0; i < h && ok; i++)
+				ok = !memcmp((char *) dst1 + i * w * 4,
+					(char *) dst2 + i * w * 4, w * bpp);
+			printf("%-10s %-8s %7.0fMB/s %7.0fMB/s %8s\n",
+				modes[m].name, fmts[f].name,
+				mb / t1, mb / t2, ok ? "ok" : "FAILED");
+			ret |= !ok;
+		}
+	}
+	free(src);
+	free(dst1);
+	free(dst2);
+	return ret;
+}
@@ -0,0 +1,408 @@
+/* on-disk cache of compressed page renders */
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <zlib.h>
+#include "cache.h"
+#include "trace.h"
+
+#define NPENDING	4		/* the maximum number of queued writes */
+#define SAMPLE		(64 << 10)	/* bytes hashed from each part of the file */
+#define NSAMPLES	32		/* sampled parts of the file */
+#define MAGIC		0x7a706266	/* "fbpz" */
+
+struct dentry {
+	struct ckey key;
+	void *pbuf;
+	int rows, cols;
+	long size;
+	struct dentry *next;
+};
+
+static char ddir[512];			/* the cache directory; empty if disabled */
+static unsigned long long dhash;	/* document hash */
+static unsigned dmode;			/* fb_mode(); 0 for gray pages */
+static long dmax = 128 << 20;		/* the maximum size of the directory */
+static long dsize;			/* the size of our files in the directory */
+static struct dentry *pending;		/* pages waiting to be written */
+static int npending;
+static pthread_mutex_t dlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dcond = PTHREAD_COND_INITIALIZER;
+static pthread_t dwriter;
+static int dquit;
+static int drunning;			/* dwriter was started */
+
+static unsigned long long fnv(unsigned long long h, unsigned char *s, long n)
+{
+	long i;
+	for (i = 0; i < n; i++)
+		h = (h ^ s[i]) * 0x100000001b3ull;
+	return h;
+}
+
+/*
+ * Hash evenly spaced parts of the file at path, its size, inode and
+ * modification time; an edit outside the sampled parts still changes
+ * the modification time, so old renders are never reused.
+ */
+static int disk_hash(char *path, unsigned long long *hash)
+{
+	unsigned long long h = 0xcbf29ce484222325ull;
+	struct stat st;
+	char *buf;
+	long off, n;
+	int fd, i;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return 1;
+	if (fstat(fd, &st) || !(buf = malloc(SAMPLE))) {
+		close(fd);
+		return 1;
+	}
+	h = fnv(h, (void *) &st.st_size, sizeof(st.st_size));
+	h = fnv(h, (void *) &st.st_ino, sizeof(st.st_ino));
+	h = fnv(h, (void *) &st.st_mtim, sizeof(st.st_mtim));
+	for (i = 0; i < NSAMPLES; i++) {
+		/* the first and the last parts are always included */
+		off = (st.st_size - SAMPLE) / (NSAMPLES - 1) * i;
+		if (off < 0 || i == NSAMPLES - 1)
+			off = st.st_size > SAMPLE ? st.st_size - SAMPLE : 0;
+		if ((n = pread(fd, buf, SAMPLE, off)) > 0)
+			h = fnv(h, (void *) buf, n);
+	}
+	free(buf);
+	close(fd);
+	*hash = h;
+	return 0;
+}
+
+static void disk_path(char *path, int len, struct ckey *key)
+{
+	snprintf(path, len, "%s/%016llx-%x-%d-%d-%d-%d.fbz", ddir, dhash, dmode,
+		key->page, key->zoom, key->rotate, key->invert);
+}
+
+struct dfile {
+	char name[256];
+	struct timespec mtime;
+	long size;
+};
+
+static int disk_cmp(const void *v1, const void *v2)
+{
+	const struct dfile *f1 = v1;
+	const struct dfile *f2 = v2;
+	if (f1->mtime.tv_sec != f2->mtime.tv_sec)
+		return f1->mtime.tv_sec < f2->mtime.tv_sec ? -1 : 1;
+	return f1->mtime.tv_nsec < f2->mtime.tv_nsec ? -1 : f1->mtime.tv_nsec > f2->mtime.tv_nsec;
+}
+
+static long disk_fsize(char *path)
+{
+	struct stat st;
+	return stat(path, &st) ? 0 : st.st_size;
+}
+
+/* rendered pages and the files of disk_file() */
+static int disk_ours(char *name)
+{
+	int len = strlen(name);
+	if (len < 5 || len >= 256)
+		return 0;
+	return !strcmp(name + len - 4, ".fbz") || !strcmp(name + len - 4, ".idx") ||
+		!strcmp(name + len - 5, ".page");
+}
+
+/* the file at path, old bytes long before, was written */
+static void disk_grew(char *path, long old)
+{
+	long size = disk_fsize(path);
+	pthread_mutex_lock(&dlock);
+	dsize += size - old;
+	pthread_mutex_unlock(&dlock);
+}
+
+/*
+ * Measure the directory and remove the least recently used files until
+ * it fits goal bytes; the index and the last page of a document age
+ * with its renders.
+ */
+static void disk_shrink(long goal)
+{
+	char path[1024];
+	struct dfile *files = NULL, *f;
+	struct dirent *de;
+	struct stat st;
+	long size = 0;
+	int n = 0, sz = 0;
+	int i;
+	DIR *d;
+	if (!(d = opendir(ddir)))
+		return;
+	while ((de = readdir(d))) {
+		if (!disk_ours(de->d_name))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", ddir, de->d_name);
+		if (stat(path, &st))
+			continue;
+		if (n == sz) {
+			sz = sz ? sz * 2 : 64;
+			if (!(f = realloc(files, sz * sizeof(files[0]))))
+				break;
+			files = f;
+		}
+		strcpy(files[n].name, de->d_name);
+		files[n].mtime = st.st_mtim;
+		files[n].size = st.st_size;
+		size += files[n++].size;
+	}
+	closedir(d);
+	if (size > goal) {
+		qsort(files, n, sizeof(files[0]), disk_cmp);
+		for (i = 0; i < n && size > goal; i++) {
+			snprintf(path, sizeof(path), "%s/%s", ddir, files[i].name);
+			if (!unlink(path))
+				size -= files[i].size;
+		}
+	}
+	free(files);
+	pthread_mutex_lock(&dlock);
+	dsize = size;
+	pthread_mutex_unlock(&dlock);
+}
+
+static int disk_write(struct dentry *e)
+{
+	char path[1024], tmp[1100];
+	uLongf len = compressBound(e->size);
+	unsigned hdr[4] = {MAGIC, e->rows, e->cols, e->size};
+	char *buf;
+	int fd, ret = 1;
+	if (!(buf = malloc(len)))
+		return 1;
+	if (compress2((void *) buf, &len, e->pbuf, e->size, 1) != Z_OK) {
+		free(buf);
+		return 1;
+	}
+	disk_path(path, sizeof(path), &e->key);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+		ret = write(fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+			write(fd, buf, len) != len;
+		close(fd);
+		/* a complete file appears at once */
+		if (ret || rename(tmp, path))
+			unlink(tmp);
+		else
+			disk_grew(path, 0);
+	}
+	free(buf);
+	return ret;
+}
+
+static void *disk_writer(void *arg)
+{
+	struct dentry *e;
+	pthread_mutex_lock(&dlock);
+	while (!dquit || pending) {
+		if (!(e = pending)) {
+			pthread_cond_wait(&dcond, &dlock);
+			continue;
+		}
+		pending = e->next;
+		npending--;
+		pthread_mutex_unlock(&dlock);
+		/* shrink below the limit, not to scan after every page */
+		if (!disk_write(e) && dsize > dmax)
+			disk_shrink(dmax - dmax / 8);
+		free(e->pbuf);
+		free(e);
+		pthread_mutex_lock(&dlock);
+	}
+	pthread_mutex_unlock(&dlock);
+	return NULL;
+}
+
+/* use dir for caching the pages of the document at path */
+int disk_open(char *dir, char *path, unsigned mode)
+{
+	struct stat st;
+	if (stat(dir, &st) && mkdir(dir, 0755))
+		return 1;
+	if (disk_hash(path, &dhash))
+		return 1;
+	snprintf(ddir, sizeof(ddir), "%s", dir);
+	dmode = mode;
+	disk_shrink(dmax);
+	dquit = 0;
+	if (pthread_create(&dwriter, NULL, disk_writer, NULL)) {
+		ddir[0] = '\0';
+		return 1;
+	}
+	drunning = 1;
+	return 0;
+}
+
+/* finish pending writes */
+void disk_close(void)
+{
+	if (!drunning)
+		return;
+	pthread_mutex_lock(&dlock);
+	dquit = 1;
+	pthread_cond_signal(&dcond);
+	pthread_mutex_unlock(&dlock);
+	pthread_join(dwriter, NULL);
+	drunning = 0;
+	ddir[0] = '\0';
+}
+
+void disk_limit(long size)
+{
+	dmax = size;
+}
+
+/* read a page from the disk; the caller owns the returned buffer */
+void *disk_get(struct ckey *key, int *rows, int *cols)
+{
+	char path[1024];
+	unsigned hdr[4];
+	struct stat st;
+	uLongf len;
+	char *buf, *pbuf = NULL;
+	long long beg = trace_now();
+	int fd;
+	if (!ddir[0])
+		return NULL;
+	disk_path(path, sizeof(path), key);
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) || read(fd, hdr, sizeof(hdr)) != sizeof(hdr) ||
+			hdr[0] != MAGIC || st.st_size <= sizeof(hdr)) {
+		close(fd);
+		return NULL;
+	}
+	len = hdr[3];
+	buf = malloc(st.st_size - sizeof(hdr));
+	pbuf = malloc(len);
+	if (buf && pbuf && read(fd, buf, st.st_size - sizeof(hdr)) ==
+			st.st_size - sizeof(hdr) &&
+			uncompress((void *) pbuf, &len, (void *) buf,
+				st.st_size - sizeof(hdr)) == Z_OK &&
+			len == hdr[3]) {
+		*rows = hdr[1];
+		*cols = hdr[2];
+		/* the modification time orders evictions */
+		futimes(fd, NULL);
+	} else {
+		free(pbuf);
+		pbuf = NULL;
+	}
+	free(buf);
+	close(fd);
+	trace_add(TR_DISK, key->page, beg);
+	return pbuf;
+}
+
+int disk_has(struct ckey *key)
+{
+	char path[1024];
+	if (!ddir[0])
+		return 0;
+	disk_path(path, sizeof(path), key);
+	return !access(path, R_OK);
+}
+
+/* queue writing a copy of a page; pages are dropped if the disk is slow */
+void disk_put(struct ckey *key, void *pbuf, int rows, int cols, long size)
+{
+	struct dentry *e;
+	struct dentry **p;
+	if (!ddir[0] || !pbuf || key->tile || disk_has(key))
+		return;
+	pthread_mutex_lock(&dlock);
+	if (npending >= NPENDING) {
+		pthread_mutex_unlock(&dlock);
+		return;
+	}
+	npending++;
+	pthread_mutex_unlock(&dlock);
+	if (!(e = malloc(sizeof(*e))) || !(e->pbuf = malloc(size))) {
+		free(e);
+		pthread_mutex_lock(&dlock);
+		npending--;
+		pthread_mutex_unlock(&dlock);
+		return;
+	}
+	memcpy(e->pbuf, pbuf, size);
+	e->key = *key;
+	e->rows = rows;
+	e->cols = cols;
+	e->size = size;
+	e->next = NULL;
+	pthread_mutex_lock(&dlock);
+	for (p = &pending; *p; p = &(*p)->next)
+		;
+	*p = e;
+	pthread_cond_signal(&dcond);
+	pthread_mutex_unlock(&dlock);
+}
+
+/* the path of a file about the document, like its last page; nonzero if disabled */
+int disk_file(char *path, int len, char *ext)
+{
+	if (!ddir[0])
+		return 1;
+	snprintf(path, len, "%s/%016llx.%s", ddir, dhash, ext);
+	return 0;
+}
+
+int disk_lastpage(void)
+{
+	char path[1024];
+	int page = 0;
+	FILE *fp;
+	if (disk_file(path, sizeof(path), "page"))
+		return 0;
+	if ((fp = fopen(path, "r"))) {
+		if (fscanf(fp, "%d", &page) != 1)
+			page = 0;
+		fclose(fp);
+	}
+	return page;
+}
+
+void disk_setpage(int page)
+{
+	char path[1024];
+	long old;
+	FILE *fp;
+	if (disk_file(path, sizeof(path), "page"))
+		return;
+	old = disk_fsize(path);
+	if ((fp = fopen(path, "w"))) {
+		fprintf(fp, "%d\n", page);
+		fclose(fp);
+	}
+	disk_grew(path, old);
+}
+
+/* write the ext file of disk_file() with save(); nonzero on failure */
+int disk_save(char *ext, int (*save)(char *path))
+{
+	char path[1024];
+	long old;
+	int ret;
+	if (disk_file(path, sizeof(path), ext))
+		return 1;
+	old = disk_fsize(path);
+	ret = save(path);
+	disk_grew(path, old);
+	return ret;
+}
@@ -1,17 +1,54 @@
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <libdjvu/ddjvuapi.h>
 #include "draw.h"
 #include "doc.h"
+#include "fload.h"
 
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
+#define BAND		64	/* rows rendered between doc_stop() checks */
+
+static int gray;		/* doc_gray() argument */
 
 struct doc {
 	ddjvu_context_t *ctx;
 	ddjvu_document_t *doc;
+	char *path;		/* the document file */
+	int preloaded;		/* streams are fed from fload() copies */
+	void *data;		/* fload() of the file until stream 0 is fed */
+	long datalen;
+	pthread_mutex_t lock;	/* protects stop and page */
+	int stop;		/* doc_stop() argument */
+	ddjvu_page_t *page;	/* the page doc_draw() is decoding */
 };
 
+/* feed the data of a document opened with ddjvu_document_create() */
+static void djvu_stream(struct doc *doc, ddjvu_message_newstream_t *msg)
+{
+	char path[1024];
+	char *dir = strrchr(doc->path, '/');
+	void *data;
+	long len;
+	/* djvulibre keeps its own copy of the data written */
+	if (!msg->streamid) {
+		ddjvu_stream_write(doc->doc, 0, doc->data, doc->datalen);
+		ddjvu_stream_close(doc->doc, 0, 0);
+		free(doc->data);
+		doc->data = NULL;
+		return;
+	}
+	/* the files of indirect documents are named relative to the index */
+	snprintf(path, sizeof(path), "%.*s%s", dir ? (int) (dir - doc->path + 1) : 0,
+		doc->path, msg->name ? msg->name : "");
+	if ((data = fload(path, &len))) {
+		ddjvu_stream_write(doc->doc, msg->streamid, data, len);
+		free(data);
+	}
+	ddjvu_stream_close(doc->doc, msg->streamid, !data);
+}
+
 int djvu_handle(struct doc *doc)
 {
 	ddjvu_message_t *msg;
@@ -21,81 +58,278 @@ int djvu_handle(struct doc *doc)
 			fprintf(stderr,"ddjvu: %s\n", msg->m_error.message);
 			return 1;
 		}
+		if (msg->m_any.tag == DDJVU_NEWSTREAM && doc->preloaded)
+			djvu_stream(doc, &msg->m_newstream);
 		ddjvu_message_pop(doc->ctx);
 	}
 	return 0;
 }
 
-static void djvu_render(ddjvu_page_t *page, int iw, int ih, void *bitmap)
+static int djvu_stopped(struct doc *doc)
+{
+	int stop;
+	pthread_mutex_lock(&doc->lock);
+	stop = doc->stop;
+	pthread_mutex_unlock(&doc->lock);
+	return stop;
+}
+
+/* render the part of the iw x ih page at tile into bitmap */
+static int djvu_render(struct doc *doc, ddjvu_page_t *page, int iw, int ih,
+		ddjvu_rect_t *tile, char *bitmap)
 {
 	ddjvu_format_t *fmt;
 	ddjvu_rect_t rect;
+	ddjvu_rect_t band;
+	unsigned masks[4];
+	int bpp = gray ? 1 : FBM_BPP(fb_mode());
+	char *rgb = NULL;
+	int i, j;
 	rect.x = 0;
 	rect.y = 0;
 	rect.w = iw;
 	rect.h = ih;
-	fmt = ddjvu_format_create(DDJVU_FORMAT_RGB24, 0, 0);
+	/* let djvulibre produce fb_val() pixels; 24-bit ones are converted */
+	masks[3] = FB_VAL(0, 0, 0);
+	masks[0] = FB_VAL(255, 0, 0) ^ masks[3];
+	masks[1] = FB_VAL(0, 255, 0) ^ masks[3];
+	masks[2] = FB_VAL(0, 0, 255) ^ masks[3];
+	if (gray)
+		fmt = ddjvu_format_create(DDJVU_FORMAT_GREY8, 0, NULL);
+	else if (bpp == 4)
+		fmt = ddjvu_format_create(DDJVU_FORMAT_RGBMASK32, 4, masks);
+	else if (bpp == 2)
+		fmt = ddjvu_format_create(DDJVU_FORMAT_RGBMASK16, 4, masks);
+	else
+		fmt = ddjvu_format_create(DDJVU_FORMAT_RGB24, 0, NULL);
+	if (!gray && bpp == 3 && !(rgb = malloc(BAND * tile->w * 3))) {
+		ddjvu_format_release(fmt);
+		return 1;
+	}
 	ddjvu_format_set_row_order(fmt, 1);
-	memset(bitmap, 0, ih * iw * 3);
-	ddjvu_page_render(page, DDJVU_RENDER_COLOR,
-				&rect, &rect, fmt, iw * 3, bitmap);
+	ddjvu_format_set_y_direction(fmt, 1);
+	memset(bitmap, 0, tile->h * tile->w * bpp);
+	for (i = 0; i < tile->h && !djvu_stopped(doc); i += BAND) {
+		band.x = tile->x;
+		band.y = tile->y + i;
+		band.w = tile->w;
+		band.h = MIN(BAND, tile->h - i);
+		ddjvu_page_render(page, DDJVU_RENDER_COLOR, &rect, &band, fmt,
+			tile->w * (rgb ? 3 : bpp), rgb ? rgb : bitmap + i * tile->w * bpp);
+		for (j = 0; rgb && j < band.h; j++)
+			fb_conv(bitmap + (i + j) * tile->w * bpp, rgb + j * tile->w * 3,
+				tile->w, FBFMT_RGB24);
+	}
 	ddjvu_format_release(fmt);
+	free(rgb);
+	return i < tile->h;
 }
 
-void *doc_draw(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
+/* decode a page and return its dimensions at zoom */
+static ddjvu_page_t *djvu_page(struct doc *doc, int p, int zoom, int rotate,
+		int *iw, int *ih)
 {
 	ddjvu_page_t *page;
-	ddjvu_pageinfo_t info;
-	int iw, ih, dpi;
-	unsigned char *bmp;
-	fbval_t *pbuf;
-	int i, j;
+	int dpi;
 	page = ddjvu_page_create_by_pageno(doc->doc, p - 1);
 	if (!page)
 		return NULL;
+	pthread_mutex_lock(&doc->lock);
+	doc->page = page;
+	if (doc->stop)
+		ddjvu_job_stop(ddjvu_page_job(page));
+	pthread_mutex_unlock(&doc->lock);
 	while (!ddjvu_page_decoding_done(page))
 		if (djvu_handle(doc))
-			return NULL;
+			break;
+	pthread_mutex_lock(&doc->lock);
+	doc->page = NULL;
+	pthread_mutex_unlock(&doc->lock);
+	if (ddjvu_page_decoding_status(page) != DDJVU_JOB_OK) {
+		ddjvu_page_release(page);
+		return NULL;
+	}
 	if (rotate)
 		ddjvu_page_set_rotation(page, (4 - (rotate / 90 % 4)) & 3);
-	ddjvu_document_get_pageinfo(doc->doc, p - 1, &info);
 	dpi = ddjvu_page_get_resolution(page);
-	iw = ddjvu_page_get_width(page) * zoom / dpi;
-	ih = ddjvu_page_get_height(page) * zoom / dpi;
-	if (!(bmp = malloc(ih * iw * 3))) {
-		ddjvu_page_release(page);
+	*iw = ddjvu_page_get_width(page) * zoom / dpi;
+	*ih = ddjvu_page_get_height(page) * zoom / dpi;
+	return page;
+}
+
+static void *djvu_draw(struct doc *doc, ddjvu_page_t *page, int iw, int ih,
+		ddjvu_rect_t *tile)
+{
+	char *pbuf;
+	if (!(pbuf = malloc(tile->h * tile->w * (gray ? 1 : FBM_BPP(fb_mode())))))
 		return NULL;
-	}
-	djvu_render(page, iw, ih, bmp);
-	ddjvu_page_release(page);
-	if (!(pbuf = malloc(ih * iw * sizeof(pbuf[0])))) {
-		free(bmp);
+	if (djvu_render(doc, page, iw, ih, tile, pbuf)) {
+		free(pbuf);
 		return NULL;
 	}
-	for (i = 0; i < ih; i++) {
-		unsigned char *src = bmp + i * iw * 3;
-		fbval_t *dst = pbuf + i * iw;
-		for (j = 0; j < iw; j++)
-			dst[j] = FB_VAL(src[j * 3], src[j * 3 + 1], src[j * 3 + 2]);
-	}
-	free(bmp);
+	return pbuf;
+}
+
+void *doc_draw(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
+{
+	ddjvu_page_t *page;
+	ddjvu_rect_t tile;
+	int iw, ih;
+	char *pbuf;
+	if (!(page = djvu_page(doc, p, zoom, rotate, &iw, &ih)))
+		return NULL;
+	tile.x = 0;
+	tile.y = 0;
+	tile.w = iw;
+	tile.h = ih;
+	pbuf = djvu_draw(doc, page, iw, ih, &tile);
+	ddjvu_page_release(page);
 	*cols = iw;
 	*rows = ih;
 	return pbuf;
 }
 
+void *doc_tile(struct doc *doc, int p, int zoom, int rotate,
+		int row, int col, int rows, int cols)
+{
+	ddjvu_page_t *page;
+	ddjvu_rect_t tile;
+	int iw, ih;
+	char *pbuf = NULL;
+	if (!(page = djvu_page(doc, p, zoom, rotate, &iw, &ih)))
+		return NULL;
+	tile.x = col;
+	tile.y = row;
+	tile.w = MIN(cols, iw - col);
+	tile.h = MIN(rows, ih - row);
+	if (col < iw && row < ih)
+		pbuf = djvu_draw(doc, page, iw, ih, &tile);
+	ddjvu_page_release(page);
+	return pbuf;
+}
+
+int doc_size(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
+{
+	ddjvu_pageinfo_t info;
+	ddjvu_status_t st;
+	int rot;
+	while ((st = ddjvu_document_get_pageinfo(doc->doc, p - 1, &info)) < DDJVU_JOB_OK)
+		if (djvu_handle(doc))
+			return 1;
+	if (st != DDJVU_JOB_OK || info.dpi <= 0)
+		return 1;
+	/* doc_draw() replaces the initial rotation of the page */
+	rot = rotate ? (4 - (rotate / 90 % 4)) & 3 : info.rotation;
+	*rows = (rot & 1 ? info.width : info.height) * zoom / info.dpi;
+	*cols = (rot & 1 ? info.height : info.width) * zoom / info.dpi;
+	return 0;
+}
+
+/* append the words in the hidden text expression e of a w x h page */
+static int djvu_words(miniexp_t e, int w, int h, int turns, float scale,
+		struct dword **words, int n)
+{
+	const char *s;
+	float box[4];
+	if (!miniexp_consp(e) || !miniexp_symbolp(miniexp_car(e)))
+		return n;
+	if (!strcmp(miniexp_to_name(miniexp_car(e)), "word")) {
+		if (!miniexp_stringp(miniexp_nth(5, e)))
+			return n;
+		s = miniexp_to_str(miniexp_nth(5, e));
+		/* djvu coordinates grow upwards */
+		box[0] = miniexp_to_int(miniexp_nth(1, e));
+		box[1] = h - miniexp_to_int(miniexp_nth(4, e));
+		box[2] = miniexp_to_int(miniexp_nth(3, e));
+		box[3] = h - miniexp_to_int(miniexp_nth(2, e));
+		return doc_word(words, n, (char *) s, strlen(s), box, w, h,
+			turns, scale) ? n : n + 1;
+	}
+	/* pages, columns, regions, paragraphs and lines hold their parts */
+	for (e = miniexp_cdr(miniexp_cdr(miniexp_cdr(miniexp_cdr(miniexp_cdr(e)))));
+			miniexp_consp(e); e = miniexp_cdr(e))
+		n = djvu_words(miniexp_car(e), w, h, turns, scale, words, n);
+	return n;
+}
+
+struct dword *doc_text(struct doc *doc, int p, int zoom, int rotate, int *n)
+{
+	struct dword *words = NULL;
+	ddjvu_pageinfo_t info;
+	ddjvu_status_t st;
+	miniexp_t e;
+	int rot;
+	*n = 0;
+	while ((st = ddjvu_document_get_pageinfo(doc->doc, p - 1, &info)) < DDJVU_JOB_OK)
+		if (djvu_handle(doc))
+			return NULL;
+	if (st != DDJVU_JOB_OK || info.dpi <= 0)
+		return NULL;
+	while ((e = ddjvu_document_get_pagetext(doc->doc, p - 1, "word")) == miniexp_dummy)
+		if (djvu_handle(doc))
+			return NULL;
+	/* ddjvu rotations are counter-clockwise; see doc_size() */
+	rot = rotate ? (4 - (rotate / 90 % 4)) & 3 : info.rotation;
+	*n = djvu_words(e, info.width, info.height, (4 - rot) & 3, (float) zoom / info.dpi, &words, 0);
+	ddjvu_miniexp_release(doc->doc, e);
+	if (!words)
+		words = malloc(sizeof(*words));
+	return words;
+}
+
+void doc_stop(struct doc *doc, int stop)
+{
+	pthread_mutex_lock(&doc->lock);
+	doc->stop = stop;
+	if (stop && doc->page)
+		ddjvu_job_stop(ddjvu_page_job(doc->page));
+	pthread_mutex_unlock(&doc->lock);
+}
+
+/* rendering is single-threaded */
+void doc_threads(int n)
+{
+}
+
+/* pages are not cached */
+void doc_cache(long size)
+{
+}
+
+void doc_gray(int on)
+{
+	gray = on;
+}
+
+int doc_stat(struct doc *doc, struct dstat *st)
+{
+	return 1;
+}
+
 int doc_pages(struct doc *doc)
 {
 	return ddjvu_document_get_pagenum(doc->doc);
 }
 
+unsigned long long doc_digest(struct doc *doc, int p)
+{
+	return 0;
+}
+
 struct doc *doc_open(char *path)
 {
-	struct doc *doc = malloc(sizeof(*doc));
+	struct doc *doc = calloc(1, sizeof(*doc));
+	pthread_mutex_init(&doc->lock, NULL);
 	doc->ctx = ddjvu_context_create("fbpdf");
 	if (!doc->ctx)
 		goto fail;
-	doc->doc = ddjvu_document_create_by_filename(doc->ctx, path, 1);
+	doc->path = strdup(path);
+	if ((doc->data = fload(path, &doc->datalen))) {
+		doc->preloaded = 1;
+		doc->doc = ddjvu_document_create(doc->ctx, NULL, 1);
+	} else {
+		doc->doc = ddjvu_document_create_by_filename(doc->ctx, path, 1);
+	}
 	if (!doc->doc)
 		goto fail;
 	while (!ddjvu_document_decoding_done(doc->doc))
@@ -110,8 +344,10 @@ fail:
 void doc_close(struct doc *doc)
 {
 	if (doc->doc)
-		ddjvu_context_release(doc->ctx);
-	if (doc->ctx)
 		ddjvu_document_release(doc->doc);
+	if (doc->ctx)
+		ddjvu_context_release(doc->ctx);
+	free(doc->data);
+	free(doc->path);
 	free(doc);
 }
@@ -1,10 +1,47 @@
-/* framebuffer depth */
+/* a pixel value; pages hold FBM_BPP(fb_mode()) bytes per pixel */
 typedef unsigned int fbval_t;
 
 /* optimized version of fb_val() */
 #define FB_VAL(r, g, b)	fb_val((r), (g), (b))
 
+/* the number of threads doc_draw() may use; zero for one per core */
+void doc_threads(int n);
+/* the size of the parsed page cache of the backend (mupdf only) */
+void doc_cache(long size);
+/* render pages as one byte gray levels instead of framebuffer pixels */
+void doc_gray(int on);
 struct doc *doc_open(char *path);
 int doc_pages(struct doc *doc);
 void *doc_draw(struct doc *doc, int page, int zoom, int rotate, int *rows, int *cols);
+/* the dimensions of the page doc_draw() would return */
+int doc_size(struct doc *doc, int page, int zoom, int rotate, int *rows, int *cols);
+/* render rows x cols pixels of the page starting at row, col */
+void *doc_tile(struct doc *doc, int page, int zoom, int rotate,
+		int row, int col, int rows, int cols);
 void doc_close(struct doc *doc);
+/* parsed page cache statistics */
+struct dstat {
+	long hits;		/* pages rendered without parsing them again */
+	long misses;		/* pages parsed */
+	long size;		/* bytes in use */
+	long limit;		/* doc_cache() argument */
+};
+/* returns nonzero if the backend has no such cache */
+int doc_stat(struct doc *doc, struct dstat *st);
+/* a hash of what page draws: equal nonzero hashes mean equal renders; 0 if unknown */
+unsigned long long doc_digest(struct doc *doc, int page);
+/* while stop is nonzero, doc_draw() gives up as soon as it can and returns NULL */
+void doc_stop(struct doc *doc, int stop);
+/* a word of the text layer and its box in doc_draw() pixels */
+struct dword {
+	char s[32];		/* UTF-8, possibly truncated */
+	int r0, c0, r1, c1;	/* rows r0 to r1 - 1 and columns c0 to c1 - 1 */
+};
+/* the words of a page; the caller frees the returned array; NULL on failure */
+struct dword *doc_text(struct doc *doc, int page, int zoom, int rotate, int *n);
+/* append a word whose box is on a w x h page, turned and scaled (words.c) */
+int doc_word(struct dword **words, int n, char *s, int len, float *box,
+		float w, float h, int turns, float scale);
+
+/* read documents into memory before opening them when on is nonzero (fload.c) */
+void doc_preload(int on);
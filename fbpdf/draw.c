@@ -6,6 +6,12 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "draw.h"
 
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
@@ -14,18 +20,220 @@
 
 static struct fb_var_screeninfo vinfo;	/* linux-specific FB structure */
 static struct fb_fix_screeninfo finfo;	/* linux-specific FB structure */
+static struct fb_var_screeninfo vinfo0;	/* vinfo before fb_dblbuf() */
 static int fd;				/* FB device file descriptor */
 static void *fb;			/* mmap()ed FB memory */
+static long fblen;			/* the length of the mapping */
 static int bpp;				/* bytes per pixel */
 static int nr, ng, nb;			/* color levels */
 static int rl, rr, gl, gr, bl, br;	/* shifts per color */
 static int xres, yres, xoff, yoff;	/* drawing region */
+static unsigned xmask;			/* bits not used by any color */
+static int simd;			/* use vector fb_conv() kernels */
+static int dbl;				/* double buffering */
+static int drawoff, showoff;		/* first row of the drawn and shown pages */
+static int ring;			/* scroll by panning; see fb_ring() */
+static int rtop;			/* the ring row shown at the top */
+static char *rdirty;			/* ring rows drawn since the last fb_flip() */
+static unsigned glut[NLEVELS];		/* fb_val() of gray levels */
+
+/* display backends: a linux framebuffer device or a framebuffer in memory */
+static struct display {
+	int (*open)(char *spec);
+	int (*ioctl)(unsigned long req, void *arg);	/* fbdev ioctls */
+	void *(*map)(long len);
+	void (*unmap)(void *mem, long len);
+	void (*shown)(void);		/* a frame is shown; may be NULL */
+	void (*close)(void);
+} *disp;
+static struct fb_var_screeninfo mvinfo;	/* the mode of memory framebuffers */
+static struct fb_fix_screeninfo mfinfo;
+static char ppmpath[512];		/* the frames dumped by the ppm display */
+static int ppmframe;
+
+/* the bytes per pixel and the offset of each color in fb_conv() layouts */
+static struct { int n, r, g, b; } fmts[] = {
+	[FBFMT_RGB24] = {3, 0, 1, 2},
+	[FBFMT_RGBX32] = {4, 0, 1, 2},
+	[FBFMT_BGRX32] = {4, 2, 1, 0},
+	[FBFMT_GRAY8] = {1, 0, 0, 0},
+};
 
 static int fb_len(void)
 {
 	return finfo.line_length * vinfo.yres_virtual;
 }
 
+static int fbdev_open(char *path)
+{
+	char *geom = strchr(path, ':');
+	if (geom) {
+		*geom = '\0';
+		sscanf(geom + 1, "%dx%d%d%d", &xres, &yres, &xoff, &yoff);
+	}
+	if ((fd = open(path, O_RDWR)) < 0)
+		return 1;
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+	return 0;
+}
+
+static int fbdev_ioctl(unsigned long req, void *arg)
+{
+	return ioctl(fd, req, arg);
+}
+
+static void *fbdev_map(long len)
+{
+	void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	return mem == MAP_FAILED ? NULL : mem;
+}
+
+static void fbdev_unmap(void *mem, long len)
+{
+	munmap(mem, len);
+}
+
+static void fbdev_close(void)
+{
+	close(fd);
+}
+
+/*
+ * Parse modes like rgb565, bgr888 or xrgb8888: the colors from the most
+ * significant bits down and their lengths; x marks unused bits.
+ */
+static int mem_mode(char *s, struct fb_var_screeninfo *v)
+{
+	struct fb_bitfield *f;
+	char *len = s + strspn(s, "rgbx");
+	int n = len - s;
+	int off = 0;
+	int i;
+	if (!n || strlen(len) != n)
+		return 1;
+	for (i = n - 1; i >= 0; i--) {
+		if (len[i] < '1' || len[i] > '8')
+			return 1;
+		f = s[i] == 'r' ? &v->red : (s[i] == 'g' ? &v->green :
+			(s[i] == 'b' ? &v->blue : NULL));
+		if (f) {
+			f->offset = off;
+			f->length = len[i] - '0';
+		}
+		off += len[i] - '0';
+	}
+	v->bits_per_pixel = off;
+	return off % 8 || off > 32 || !v->red.length || !v->green.length || !v->blue.length;
+}
+
+/* a framebuffer in memory: WxH[:mode] */
+static int mem_open(char *spec)
+{
+	char *mode = spec ? strchr(spec, ':') : NULL;
+	int w = 1920, h = 1080;
+	if (spec && *spec && sscanf(spec, "%dx%d", &w, &h) != 2)
+		return 1;
+	memset(&mvinfo, 0, sizeof(mvinfo));
+	memset(&mfinfo, 0, sizeof(mfinfo));
+	if (w <= 0 || h <= 0 || mem_mode(mode ? mode + 1 : "xrgb8888", &mvinfo))
+		return 1;
+	mvinfo.xres = w;
+	mvinfo.yres = h;
+	mvinfo.xres_virtual = w;
+	mvinfo.yres_virtual = h;
+	mfinfo.visual = FB_VISUAL_TRUECOLOR;
+	mfinfo.line_length = w * mvinfo.bits_per_pixel / 8;
+	return 0;
+}
+
+/* panning and resizing the virtual screen always work */
+static int mem_ioctl(unsigned long req, void *arg)
+{
+	struct fb_var_screeninfo *v = arg;
+	switch (req) {
+	case FBIOGET_VSCREENINFO:
+		*v = mvinfo;
+		return 0;
+	case FBIOGET_FSCREENINFO:
+		memcpy(arg, &mfinfo, sizeof(mfinfo));
+		return 0;
+	case FBIOPUT_VSCREENINFO:
+		mvinfo.yres_virtual = MAX(mvinfo.yres, v->yres_virtual);
+		/* fall through */
+	case FBIOPAN_DISPLAY:
+		if (v->yoffset + mvinfo.yres > mvinfo.yres_virtual)
+			return -1;
+		mvinfo.yoffset = v->yoffset;
+		return 0;
+	}
+	return 0;
+}
+
+static void *mem_map(long len)
+{
+	void *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return mem == MAP_FAILED ? NULL : mem;
+}
+
+static void mem_close(void)
+{
+}
+
+/* a framebuffer in memory whose frames are written to files: path[:WxH[:mode]] */
+static int ppm_open(char *spec)
+{
+	char *geom = strchr(spec, ':');
+	char *pct;
+	if (geom)
+		*geom++ = '\0';
+	/* only a frame number may be substituted */
+	pct = strchr(spec, '%');
+	if (!*spec || (pct && (pct[1] != 'd' || strchr(pct + 1, '%'))))
+		return 1;
+	snprintf(ppmpath, sizeof(ppmpath), "%s", spec);
+	ppmframe = 0;
+	return mem_open(geom);
+}
+
+/* write the visible screen; a %d in the path is replaced with the frame number */
+static void ppm_shown(void)
+{
+	int len[3] = {vinfo.red.length, vinfo.green.length, vinfo.blue.length};
+	int off[3] = {vinfo.red.offset, vinfo.green.offset, vinfo.blue.offset};
+	char path[1024];
+	unsigned char *row, *s;
+	unsigned v;
+	FILE *fp;
+	int i, j, k;
+	snprintf(path, sizeof(path), ppmpath, ppmframe++);
+	if (!(fp = fopen(path, "w")) || !(row = malloc(vinfo.xres * 3))) {
+		if (fp)
+			fclose(fp);
+		return;
+	}
+	fprintf(fp, "P6\n%d %d\n255\n", vinfo.xres, vinfo.yres);
+	for (i = 0; i < vinfo.yres; i++) {
+		s = (unsigned char *) fb + (vinfo.yoffset + i) * finfo.line_length;
+		for (j = 0; j < vinfo.xres; j++, s += bpp) {
+			v = s[0] | (bpp > 1 ? s[1] << 8 : 0) | (bpp > 2 ? s[2] << 16 : 0) |
+				(bpp > 3 ? (unsigned) s[3] << 24 : 0);
+			/* scale each color to 8 bits */
+			for (k = 0; k < 3; k++)
+				row[j * 3 + k] = ((v >> off[k]) & ((1 << len[k]) - 1)) *
+					255 / ((1 << len[k]) - 1);
+		}
+		fwrite(row, 3, vinfo.xres, fp);
+	}
+	free(row);
+	fclose(fp);
+}
+
+static struct display displays[] = {
+	{fbdev_open, fbdev_ioctl, fbdev_map, fbdev_unmap, NULL, fbdev_close},
+	{mem_open, mem_ioctl, mem_map, fbdev_unmap, NULL, mem_close},
+	{ppm_open, mem_ioctl, mem_map, fbdev_unmap, ppm_shown, mem_close},
+};
+
 static void fb_cmap_save(int save)
 {
 	static unsigned short red[NLEVELS], green[NLEVELS], blue[NLEVELS];
@@ -38,7 +246,7 @@ static void fb_cmap_save(int save)
 	cmap.green = green;
 	cmap.blue = blue;
 	cmap.transp = NULL;
-	ioctl(fd, save ? FBIOGETCMAP : FBIOPUTCMAP, &cmap);
+	disp->ioctl(save ? FBIOGETCMAP : FBIOPUTCMAP, &cmap);
 }
 
 void fb_cmap(void)
@@ -63,7 +271,7 @@ void fb_cmap(void)
 	cmap.blue = blue;
 	cmap.transp = NULL;
 
-	ioctl(fd, FBIOPUTCMAP, &cmap);
+	disp->ioctl(FBIOPUTCMAP, &cmap);
 }
 
 unsigned fb_mode(void)
@@ -75,6 +283,7 @@ unsigned fb_mode(void)
 
 static void init_colors(void)
 {
+	int i;
 	nr = 1 << vinfo.red.length;
 	ng = 1 << vinfo.blue.length;
 	nb = 1 << vinfo.green.length;
@@ -84,43 +293,89 @@ static void init_colors(void)
 	gl = vinfo.green.offset;
 	br = 8 - vinfo.blue.length;
 	bl = vinfo.blue.offset;
+	xmask = bpp < 4 ? 0 : ~((((1u << vinfo.red.length) - 1) << rl) |
+			(((1u << vinfo.green.length) - 1) << gl) |
+			(((1u << vinfo.blue.length) - 1) << bl));
+	simd = !getenv("FBPDF_NOSIMD");
+	for (i = 0; i < NLEVELS; i++)
+		glut[i] = fb_val(i, i, i);
 }
 
+/* set up fb_mode() mode without a device; colors are packed from bit 0 */
+void fb_setmode(unsigned mode)
+{
+	struct fb_bitfield *clr[3] = {&vinfo.red, &vinfo.green, &vinfo.blue};
+	int len[3] = {(mode >> 8) & 0x0f, (mode >> 4) & 0x0f, mode & 0x0f};
+	int rank[3];
+	int i, j;
+	rank[0] = !(mode & (1 << 22)) + !(mode & (1 << 21));
+	rank[1] = !!(mode & (1 << 22)) + !(mode & (1 << 20));
+	rank[2] = !!(mode & (1 << 21)) + !!(mode & (1 << 20));
+	memset(&vinfo, 0, sizeof(vinfo));
+	memset(&finfo, 0, sizeof(finfo));
+	finfo.visual = FB_VISUAL_TRUECOLOR;
+	bpp = FBM_BPP(mode);
+	vinfo.bits_per_pixel = bpp * 8;
+	for (i = 0; i < 3; i++) {
+		clr[i]->length = len[i];
+		for (j = 0; j < 3; j++)
+			if (rank[j] < rank[i])
+				clr[i]->offset += len[j];
+	}
+	init_colors();
+}
+
+/*
+ * Open the display dev: a framebuffer device with an optional drawing
+ * region (/dev/fb0:WxH+X+Y), mem:WxH[:mode] for a framebuffer in memory
+ * or ppm:path[:WxH[:mode]] for one whose frames are written to path.
+ */
 int fb_init(char *dev)
 {
 	char *path = dev ? dev : FBDEV;
-	char *geom = dev ? strchr(dev, ':') : NULL;
-	if (geom) {
-		*geom = '\0';
-		sscanf(geom + 1, "%dx%d%d%d", &xres, &yres, &xoff, &yoff);
+	disp = &displays[0];
+	if (!strncmp(path, "mem:", 4) || !strcmp(path, "mem")) {
+		disp = &displays[1];
+		path += path[3] ? 4 : 3;
+	} else if (!strncmp(path, "ppm:", 4)) {
+		disp = &displays[2];
+		path += 4;
 	}
-	fd = open(path, O_RDWR);
-	if (fd < 0)
-		goto failed;
-	if (ioctl(fd, FBIOGET_VSCREENINFO, &vinfo) < 0)
+	if (disp->open(path)) {
+		fprintf(stderr, "fb_init(): cannot open <%s>\n", dev ? dev : FBDEV);
+		return 1;
+	}
+	if (disp->ioctl(FBIOGET_VSCREENINFO, &vinfo) < 0)
 		goto failed;
-	if (ioctl(fd, FBIOGET_FSCREENINFO, &finfo) < 0)
+	if (disp->ioctl(FBIOGET_FSCREENINFO, &finfo) < 0)
 		goto failed;
-	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
 	bpp = (vinfo.bits_per_pixel + 7) >> 3;
-	fb = mmap(NULL, fb_len(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (fb == MAP_FAILED)
+	if (!(fb = disp->map(fb_len())))
 		goto failed;
+	fblen = fb_len();
+	vinfo0 = vinfo;
+	drawoff = vinfo.yoffset;
+	showoff = vinfo.yoffset;
 	init_colors();
 	fb_cmap_save(1);
 	fb_cmap();
 	return 0;
 failed:
 	perror("fb_init()");
-	close(fd);
+	disp->close();
 	return 1;
 }
 
 void fb_free(void)
 {
 	fb_cmap_save(0);
-	munmap(fb, fb_len());
-	close(fd);
+	if (vinfo.yres_virtual != vinfo0.yres_virtual)
+		disp->ioctl(FBIOPUT_VSCREENINFO, &vinfo0);
+	else if (vinfo.yoffset != vinfo0.yoffset)
+		disp->ioctl(FBIOPAN_DISPLAY, &vinfo0);
+	free(rdirty);
+	disp->unmap(fb, fblen);
+	disp->close();
 }
 
 int fb_rows(void)
@@ -133,12 +388,409 @@ int fb_cols(void)
 	return xres ? xres : vinfo.xres;
 }
 
+static void *fb_at(int off, int r)
+{
+	return fb + (r + off + yoff) * finfo.line_length + (vinfo.xoffset + xoff) * bpp;
+}
+
 void *fb_mem(int r)
 {
-	return fb + (r + vinfo.yoffset + yoff) * finfo.line_length + (vinfo.xoffset + xoff) * bpp;
+	if (ring) {
+		r = (rtop + r) % vinfo.yres;
+		rdirty[r] = 1;
+		return fb_at(0, r);
+	}
+	return fb_at(drawoff, r);
+}
+
+/* make the virtual screen twice as high as the visible one */
+static int fb_double(void)
+{
+	struct fb_var_screeninfo v = vinfo;
+	void *mem;
+	if (vinfo.yres_virtual < vinfo.yres * 2) {
+		v.yres_virtual = vinfo.yres * 2;
+		v.yoffset = 0;
+		disp->ioctl(FBIOPUT_VSCREENINFO, &v);
+		if (disp->ioctl(FBIOGET_VSCREENINFO, &v) < 0 ||
+				disp->ioctl(FBIOGET_FSCREENINFO, &finfo) < 0)
+			return 1;
+		if (v.yres_virtual == vinfo.yres_virtual)
+			return 1;
+		vinfo = v;
+		if (!(mem = disp->map(fb_len()))) {
+			disp->ioctl(FBIOPUT_VSCREENINFO, &vinfo0);
+			disp->ioctl(FBIOGET_VSCREENINFO, &vinfo);
+			disp->ioctl(FBIOGET_FSCREENINFO, &finfo);
+			return 1;
+		}
+		disp->unmap(fb, fblen);
+		fb = mem;
+		fblen = fb_len();
+		if (vinfo.yres_virtual < vinfo.yres * 2)
+			return 1;
+	}
+	return 0;
+}
+
+/* undo fb_double() */
+static void fb_single(void)
+{
+	void *mem;
+	if (vinfo.yres_virtual != vinfo0.yres_virtual) {
+		disp->ioctl(FBIOPUT_VSCREENINFO, &vinfo0);
+		disp->ioctl(FBIOGET_VSCREENINFO, &vinfo);
+		disp->ioctl(FBIOGET_FSCREENINFO, &finfo);
+		/* the larger mapping still covers the screen if this fails */
+		if ((mem = disp->map(fb_len()))) {
+			disp->unmap(fb, fblen);
+			fb = mem;
+			fblen = fb_len();
+		}
+	}
+	drawoff = vinfo.yoffset;
+	showoff = vinfo.yoffset;
+}
+
+static int fb_pan(int off)
+{
+	vinfo.yoffset = off;
+	return disp->ioctl(FBIOPAN_DISPLAY, &vinfo) < 0;
+}
+
+/* draw to the hidden half of the virtual screen and show it with fb_flip() */
+int fb_dblbuf(void)
+{
+	if (ring || fb_double())
+		return 1;
+	showoff = vinfo.yoffset;
+	drawoff = showoff >= vinfo.yres ? 0 : vinfo.yres;
+	/* some drivers, like efifb, report a tall virtual screen but cannot pan */
+	if (fb_pan(drawoff) || fb_pan(showoff)) {
+		fb_pan(showoff);
+		fb_single();
+		return 1;
+	}
+	dbl = 1;
+	return 0;
+}
+
+/*
+ * Scroll by panning: the upper half of the virtual screen is a ring of
+ * rows starting at rtop and the lower half mirrors it, so that any yres
+ * consecutive rows can be shown.  fb_scroll() then only moves rtop and
+ * fb_flip() copies the rows drawn since the last flip to the mirror.
+ */
+int fb_ring(void)
+{
+	if (dbl || yres || yoff || fb_double())
+		return 1;
+	/* the driver should be able to show any row at the top */
+	if (fb_pan(1) || fb_pan(0) || !(rdirty = calloc(vinfo.yres, 1))) {
+		fb_pan(0);
+		fb_single();
+		return 1;
+	}
+	ring = 1;
+	rtop = 0;
+	drawoff = 0;
+	return 0;
+}
+
+/* the refresh rate of the display in Hz; 60 if unknown */
+int fb_hz(void)
+{
+	long htotal = vinfo.xres + vinfo.left_margin + vinfo.right_margin + vinfo.hsync_len;
+	long vtotal = vinfo.yres + vinfo.upper_margin + vinfo.lower_margin + vinfo.vsync_len;
+	long hz;
+	if (!vinfo.pixclock)
+		return 60;
+	/* pixclock is in picoseconds */
+	hz = 1000000000000ll / ((long long) vinfo.pixclock * htotal * vtotal);
+	return hz >= 20 && hz <= 250 ? hz : 60;
+}
+
+/*
+ * Show the page drawn since the last fb_flip().  Returns nonzero if
+ * panning failed and double buffering was given up; the page should
+ * then be drawn again, this time on the visible screen.
+ */
+int fb_flip(void)
+{
+	unsigned arg = 0;
+	int off = showoff;
+	int i;
+	if (ring) {
+		for (i = 0; i < vinfo.yres; i++) {
+			if (rdirty[i])
+				memcpy(fb_at(vinfo.yres, i), fb_at(0, i), fb_cols() * bpp);
+			rdirty[i] = 0;
+		}
+		vinfo.yoffset = rtop;
+		if (disp->ioctl(FBIOPAN_DISPLAY, &vinfo) == 0)
+			disp->ioctl(FBIO_WAITFORVSYNC, &arg);
+	} else if (dbl) {
+		if (fb_pan(drawoff)) {
+			fb_pan(showoff);
+			dbl = 0;
+			fb_single();
+			return 1;
+		}
+		disp->ioctl(FBIO_WAITFORVSYNC, &arg);
+		showoff = drawoff;
+		drawoff = off;
+	}
+	if (disp->shown)
+		disp->shown();
+	return 0;
+}
+
+/* fill the drawing region with what is shown, moved n rows up (down if negative) */
+void fb_scroll(int n)
+{
+	int rows = fb_rows() - abs(n);
+	int len = fb_cols() * bpp;
+	int i;
+	if (rows <= 0)
+		return;
+	if (ring) {
+		rtop = ((rtop + n) % vinfo.yres + vinfo.yres) % vinfo.yres;
+		return;
+	}
+	if (dbl) {
+		for (i = 0; i < rows; i++)
+			memcpy(fb_at(drawoff, n > 0 ? i : i - n),
+				fb_at(showoff, n > 0 ? i + n : i), len);
+		return;
+	}
+	if (len == finfo.line_length) {
+		if (n > 0)
+			memmove(fb_mem(0), fb_mem(n), rows * len);
+		else
+			memmove(fb_mem(-n), fb_mem(0), rows * len);
+		return;
+	}
+	if (n > 0)
+		for (i = 0; i < rows; i++)
+			memmove(fb_mem(i), fb_mem(i + n), len);
+	else
+		for (i = rows - 1; i >= 0; i--)
+			memmove(fb_mem(i - n), fb_mem(i), len);
 }
 
 unsigned fb_val(int r, int g, int b)
 {
-	return ((r >> rr) << rl) | ((g >> gr) << gl) | ((b >> br) << bl);
+	return ((r >> rr) << rl) | ((g >> gr) << gl) | ((b >> br) << bl) | xmask;
+}
+
+/* the layout of fb_val() pixels in memory, if the backends can produce it */
+int fb_fmt(void)
+{
+	unsigned one = 1;
+	if (bpp < 3 || !*(unsigned char *) &one)
+		return 0;
+	if (vinfo.red.length != 8 || vinfo.green.length != 8 || vinfo.blue.length != 8)
+		return 0;
+	if (bpp == 3)
+		return rl == 0 && gl == 8 && bl == 16 ? FBFMT_RGB24 : 0;
+	if (rl == 16 && gl == 8 && bl == 0)
+		return FBFMT_BGRX32;
+	if (rl == 0 && gl == 8 && bl == 16)
+		return FBFMT_RGBX32;
+	return 0;
+}
+
+#define CONV(s)	((((s)[so_r] >> rr) << rl) | (((s)[so_g] >> gr) << gl) | \
+		(((s)[so_b] >> br) << bl) | xmask)
+
+/* one loop for each pixel size, so that the compiler can unroll them */
+static void conv_c(void *dst, unsigned char *s, int n, int fmt)
+{
+	int sn = fmts[fmt].n, so_r = fmts[fmt].r, so_g = fmts[fmt].g, so_b = fmts[fmt].b;
+	unsigned short *d16 = dst;
+	unsigned char *d8 = dst;
+	unsigned *d32 = dst;
+	unsigned v;
+	int i;
+	if (bpp == 4) {
+		for (i = 0; i < n; i++, s += sn)
+			d32[i] = CONV(s);
+	} else if (bpp == 2) {
+		for (i = 0; i < n; i++, s += sn)
+			d16[i] = CONV(s);
+	} else {
+		for (i = 0; i < n; i++, s += sn) {
+			v = CONV(s);
+			d8[i * 3 + 0] = v;
+			d8[i * 3 + 1] = v >> 8;
+			d8[i * 3 + 2] = v >> 16;
+		}
+	}
+}
+
+/* expand n gray levels at src to pixels through a lookup table */
+void fb_gray(void *dst, void *src, int n)
+{
+	unsigned char *s = src;
+	unsigned short *d16 = dst;
+	unsigned char *d8 = dst;
+	unsigned *d32 = dst;
+	unsigned v;
+	int i;
+	if (bpp == 4) {
+		for (i = 0; i < n; i++)
+			d32[i] = glut[s[i]];
+	} else if (bpp == 2) {
+		for (i = 0; i < n; i++)
+			d16[i] = glut[s[i]];
+	} else {
+		for (i = 0; i < n; i++) {
+			v = glut[s[i]];
+			d8[i * 3 + 0] = v;
+			d8[i * 3 + 1] = v >> 8;
+			d8[i * 3 + 2] = v >> 16;
+		}
+	}
+}
+
+/* replace n pixels of FBM_BPP(fb_mode()) bytes at dst with (pixel & mask) ^ flip */
+void fb_andxor(void *dst, unsigned mask, unsigned flip, int n)
+{
+	unsigned short *d16 = dst;
+	unsigned char *d8 = dst;
+	unsigned *d32 = dst;
+	unsigned char m[3] = {mask, mask >> 8, mask >> 16};
+	unsigned char f[3] = {flip, flip >> 8, flip >> 16};
+	int i;
+	if (bpp == 4) {
+		for (i = 0; i < n; i++)
+			d32[i] = (d32[i] & mask) ^ flip;
+	} else if (bpp == 2) {
+		for (i = 0; i < n; i++)
+			d16[i] = (d16[i] & mask) ^ flip;
+	} else {
+		for (i = 0; i < n * 3; i += 3) {
+			d8[i + 0] = (d8[i + 0] & m[0]) ^ f[0];
+			d8[i + 1] = (d8[i + 1] & m[1]) ^ f[1];
+			d8[i + 2] = (d8[i + 2] & m[2]) ^ f[2];
+		}
+	}
+}
+
+#ifdef __ARM_NEON
+/* 16 pixels at a time; vld3/vld4 split the colors */
+static int conv_neon(void *dst, unsigned char *s, int n, int fmt)
+{
+	int16x8_t rr16 = vdupq_n_s16(-rr), gr16 = vdupq_n_s16(-gr), br16 = vdupq_n_s16(-br);
+	int16x8_t rl16 = vdupq_n_s16(rl), gl16 = vdupq_n_s16(gl), bl16 = vdupq_n_s16(bl);
+	int32x4_t rl32 = vdupq_n_s32(rl), gl32 = vdupq_n_s32(gl), bl32 = vdupq_n_s32(bl);
+	uint32x4_t x32 = vdupq_n_u32(xmask);
+	uint8x16_t r, g, b;
+	uint16x8_t r16[2], g16[2], b16[2];
+	int i, j, k;
+	if (bpp != 2 && bpp != 4)
+		return 0;
+	for (i = 0; i + 16 <= n; i += 16) {
+		if (fmt == FBFMT_RGB24) {
+			uint8x16x3_t v = vld3q_u8(s + i * 3);
+			r = v.val[0], g = v.val[1], b = v.val[2];
+		} else if (fmt == FBFMT_GRAY8) {
+			r = g = b = vld1q_u8(s + i);
+		} else {
+			uint8x16x4_t v = vld4q_u8(s + i * 4);
+			r = v.val[fmts[fmt].r], g = v.val[1], b = v.val[fmts[fmt].b];
+		}
+		/* drop the low bits of each color in 16-bit lanes */
+		r16[0] = vshlq_u16(vmovl_u8(vget_low_u8(r)), rr16);
+		r16[1] = vshlq_u16(vmovl_u8(vget_high_u8(r)), rr16);
+		g16[0] = vshlq_u16(vmovl_u8(vget_low_u8(g)), gr16);
+		g16[1] = vshlq_u16(vmovl_u8(vget_high_u8(g)), gr16);
+		b16[0] = vshlq_u16(vmovl_u8(vget_low_u8(b)), br16);
+		b16[1] = vshlq_u16(vmovl_u8(vget_high_u8(b)), br16);
+		for (j = 0; j < 2; j++) {
+			if (bpp == 2) {
+				uint16x8_t v = vorrq_u16(vshlq_u16(r16[j], rl16),
+					vorrq_u16(vshlq_u16(g16[j], gl16),
+						vshlq_u16(b16[j], bl16)));
+				vst1q_u16((unsigned short *) dst + i + j * 8, v);
+				continue;
+			}
+			for (k = 0; k < 2; k++) {
+				uint32x4_t rk = vmovl_u16(k ? vget_high_u16(r16[j]) : vget_low_u16(r16[j]));
+				uint32x4_t gk = vmovl_u16(k ? vget_high_u16(g16[j]) : vget_low_u16(g16[j]));
+				uint32x4_t bk = vmovl_u16(k ? vget_high_u16(b16[j]) : vget_low_u16(b16[j]));
+				uint32x4_t v = vorrq_u32(vorrq_u32(vshlq_u32(rk, rl32),
+					vshlq_u32(gk, gl32)), vorrq_u32(vshlq_u32(bk, bl32), x32));
+				vst1q_u32((unsigned *) dst + i + j * 8 + k * 4, v);
+			}
+		}
+	}
+	return i;
+}
+#endif
+
+#ifdef __SSE2__
+/* 8 pixels at a time; rgb24 has no cheap SSE2 shuffle and is left to conv_c() */
+static int conv_sse2(void *dst, unsigned char *s, int n, int fmt)
+{
+	__m128i rrc = _mm_cvtsi32_si128(rr), grc = _mm_cvtsi32_si128(gr), brc = _mm_cvtsi32_si128(br);
+	__m128i rlc = _mm_cvtsi32_si128(rl), glc = _mm_cvtsi32_si128(gl), blc = _mm_cvtsi32_si128(bl);
+	__m128i rsc = _mm_cvtsi32_si128(fmts[fmt].r * 8);
+	__m128i bsc = _mm_cvtsi32_si128(fmts[fmt].b * 8);
+	__m128i m8 = _mm_set1_epi32(0xff);
+	__m128i x32 = _mm_set1_epi32(xmask);
+	__m128i zero = _mm_setzero_si128();
+	__m128i r[2], g[2], b[2], v;
+	int i, j;
+	if ((bpp != 2 && bpp != 4) || fmt == FBFMT_RGB24)
+		return 0;
+	for (i = 0; i + 8 <= n; i += 8) {
+		/* the colors of 4 pixels in the 32-bit lanes of r[j], g[j], b[j] */
+		for (j = 0; j < 2; j++) {
+			if (fmt == FBFMT_GRAY8) {
+				int g4;
+				memcpy(&g4, s + i + j * 4, 4);
+				v = _mm_cvtsi32_si128(g4);
+				v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(v, zero), zero);
+				r[j] = g[j] = b[j] = v;
+			} else {
+				v = _mm_loadu_si128((__m128i *) (s + (i + j * 4) * 4));
+				r[j] = _mm_and_si128(_mm_srl_epi32(v, rsc), m8);
+				g[j] = _mm_and_si128(_mm_srli_epi32(v, 8), m8);
+				b[j] = _mm_and_si128(_mm_srl_epi32(v, bsc), m8);
+			}
+		}
+		if (bpp == 2) {
+			__m128i r16 = _mm_sll_epi16(_mm_srl_epi16(_mm_packs_epi32(r[0], r[1]), rrc), rlc);
+			__m128i g16 = _mm_sll_epi16(_mm_srl_epi16(_mm_packs_epi32(g[0], g[1]), grc), glc);
+			__m128i b16 = _mm_sll_epi16(_mm_srl_epi16(_mm_packs_epi32(b[0], b[1]), brc), blc);
+			v = _mm_or_si128(r16, _mm_or_si128(g16, b16));
+			_mm_storeu_si128((__m128i *) ((unsigned short *) dst + i), v);
+			continue;
+		}
+		for (j = 0; j < 2; j++) {
+			v = _mm_or_si128(_mm_sll_epi32(_mm_srl_epi32(r[j], rrc), rlc),
+				_mm_sll_epi32(_mm_srl_epi32(g[j], grc), glc));
+			v = _mm_or_si128(v, _mm_sll_epi32(_mm_srl_epi32(b[j], brc), blc));
+			v = _mm_or_si128(v, x32);
+			_mm_storeu_si128((__m128i *) ((unsigned *) dst + i + j * 4), v);
+		}
+	}
+	return i;
+}
+#endif
+
+/* convert n pixels of the given layout to pixels of FBM_BPP(fb_mode()) bytes */
+void fb_conv(void *dst, void *src, int n, int fmt)
+{
+	unsigned char *s = src;
+	int i = 0;
+#ifdef __ARM_NEON
+	if (simd)
+		i = conv_neon(dst, s, n, fmt);
+#elif defined(__SSE2__)
+	if (simd)
+		i = conv_sse2(dst, s, n, fmt);
+#endif
+	conv_c((unsigned char *) dst + i * bpp, s + i * fmts[fmt].n, n - i, fmt);
 }
@@ -6,6 +6,12 @@
 #define FBM_CLR(m)	((m) & 0x0fff)		/* bits per color (12 bits) */
 #define FBM_ORD(m)	(((m) >> 20) & 0x07)	/* color order (3 bits) */
 
+/* pixel layouts for fb_fmt() and fb_conv() */
+#define FBFMT_RGB24	1	/* bytes r, g, b */
+#define FBFMT_RGBX32	2	/* bytes r, g, b, x */
+#define FBFMT_BGRX32	3	/* bytes b, g, r, x */
+#define FBFMT_GRAY8	4	/* byte gray level */
+
 /* main functions */
 int fb_init(char *dev);
 void fb_free(void);
@@ -14,4 +20,14 @@ void *fb_mem(int r);
 int fb_rows(void);
 int fb_cols(void);
 void fb_cmap(void);
+void fb_scroll(int n);
+int fb_dblbuf(void);
+int fb_ring(void);
+int fb_hz(void);
+int fb_flip(void);
 unsigned fb_val(int r, int g, int b);
+int fb_fmt(void);
+void fb_conv(void *dst, void *src, int n, int fmt);
+void fb_andxor(void *dst, unsigned mask, unsigned flip, int n);
+void fb_gray(void *dst, void *src, int n);
+void fb_setmode(unsigned mode);
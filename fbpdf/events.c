@@ -1,349 +1,262 @@
-
-#include <linux/input.h>
+/* input devices: evdev nodes with keys, hotplugged through inotify */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
-#include <stdint.h>
-#include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
-#include <dirent.h>
+#include <unistd.h>
+#include <sys/epoll.h>
 #include <sys/inotify.h>
-
-#include <sys/poll.h>
+#include <sys/ioctl.h>
 #include <linux/input.h>
-#include <stdlib.h>
-#define NUMDEV 30
-#define NUMBUTTONS         32
-#define UINPUT_NAME "MiSTer virtual input"
-int mfd = -1;
-
-
-static struct pollfd pool[NUMDEV + 3];
-
-typedef struct
-{
-	uint16_t vid, pid;
-	char     idstr[256];
-	char     mod;
-
-	uint8_t  led;
-	uint8_t  mouse;
-	uint8_t  axis_edge[256];
-	int8_t   axis_pos[256];
-
-	uint8_t  num;
-	uint8_t  has_map;
-	uint32_t map[NUMBUTTONS];
-	int      map_shown;
-
-	uint8_t  osd_combo;
-
-	uint8_t  has_mmap;
-	uint32_t mmap[NUMBUTTONS];
-	uint16_t jkmap[1024];
-	int      stick_l[2];
-	int      stick_r[2];
+#include "events.h"
 
-	uint8_t  has_kbdmap;
-	uint8_t  kbdmap[256];
+#define INPUTDIR	"/dev/input"
+#define ID_WATCH	1		/* epoll tag of the inotify descriptor */
+#define ID_DEV		16		/* epoll tags of devices start here */
+#define NREADY		32		/* epoll events handled at once */
+#define NAXES		(ABS_RY + 1)	/* axes scaled to -AXISMAX to AXISMAX */
 
-	uint16_t guncal[4];
+struct dev {
+	int fd;				/* -1 if the slot is free */
+	char name[32];			/* the node name in INPUTDIR */
+	int amin[NAXES], amax[NAXES];	/* axis ranges */
+};
 
-	int      accx, accy;
-	int      startx, starty;
-	int      lastx, lasty;
-	int      quirk;
+static int efd = -1;			/* epoll descriptor */
+static int wfd = -1;			/* inotify descriptor watching INPUTDIR */
+static struct dev *devs;		/* open devices */
+static int ndevs;			/* allocated slots in devs[] */
 
-	int      misc_flags;
-	int      paddle_val;
-	int      spinner_prev;
-	int      spinner_acc;
-	int      spinner_prediv;
-	int      spinner_dir;
-	int      spinner_accept;
-	int      old_btn;
-	int      ds_mouse_emu;
+#define test_bit(bit, array)	((array)[(bit) / 8] & (1 << ((bit) % 8)))
 
-	int      lightgun_req;
-	int      lightgun;
-
-	int      timeout;
-	char     mac[64];
-
-	int      bind;
-	char     devname[32];
-	char     id[80];
-	char     name[128];
-	char     sysfs[512];
-} devInput;
-
-static devInput input[NUMDEV] = {};
-
-#define EVENT_SIZE  ( sizeof (struct inotify_event) )
-#define BUF_LEN     ( 1024 * ( EVENT_SIZE + 16 ) )
-
-static int check_devs()
+/* does the device report key events? */
+static int dev_haskeys(int fd)
 {
-	int result = 0;
-	int length, i = 0;
-	char buffer[BUF_LEN];
-	length = read(mfd, buffer, BUF_LEN);
-
-	if (length < 0)
-	{
-		printf("ERR: read\n");
+	unsigned char bits[EV_MAX / 8 + 1];
+	memset(bits, 0, sizeof(bits));
+	if (ioctl(fd, EVIOCGBIT(0, sizeof(bits)), bits) < 0)
 		return 0;
-	}
+	return test_bit(EV_KEY, bits) != 0;
+}
 
-	while (i<length)
-	{
-		struct inotify_event *event = (struct inotify_event *) &buffer[i];
-		if (event->len)
-		{
-			if (event->mask & IN_CREATE)
-			{
-				result = 1;
-				if (event->mask & IN_ISDIR)
-				{
-					printf("The directory %s was created.\n", event->name);
-				}
-				else
-				{
-					printf("The file %s was created.\n", event->name);
-				}
-			}
-			else if (event->mask & IN_DELETE)
-			{
-				result = 1;
-				if (event->mask & IN_ISDIR)
-				{
-					printf("The directory %s was deleted.\n", event->name);
-				}
-				else
-				{
-					printf("The file %s was deleted.\n", event->name);
-				}
-			}
-			/*
-			else if ( event->mask & IN_MODIFY )
-			{
-				result = 1;
-				if ( event->mask & IN_ISDIR )
-				{
-					printf( "The directory %s was modified.\n", event->name );
-				}
-				else
-				{
-					printf( "The file %s was modified.\n", event->name );
-				}
-			}
-			*/
+static void dev_axes(struct dev *d)
+{
+	struct input_absinfo ai;
+	int i;
+	for (i = 0; i < NAXES; i++) {
+		d->amin[i] = 0;
+		d->amax[i] = 0;
+		if (!ioctl(d->fd, EVIOCGABS(i), &ai)) {
+			d->amin[i] = ai.minimum;
+			d->amax[i] = ai.maximum;
 		}
-		i += EVENT_SIZE + event->len;
 	}
-
-	return result;
 }
 
-#define test_bit(bit, array)  (array [bit / 8] & (1 << (bit % 8)))
-int open_input_devices()
+/* scale stick positions to -AXISMAX to AXISMAX, whatever the device */
+static void dev_scale(struct dev *d, struct input_event *ev, int n)
 {
-	int yalv;
-	uint8_t key_b[KEY_MAX/8 + 1];
-
-	int timeout = 1000;
-	//printf("Open up to %d input devices.\n", NUMDEV);
-	for (int i = 0; i < NUMDEV; i++)
-	{
-		pool[i].fd = -1;
-		pool[i].events = 0;
+	int i, a;
+	for (i = 0; i < n; i++) {
+		if (ev[i].type != EV_ABS || ev[i].code >= NAXES)
+			continue;
+		a = ev[i].code;
+		if (d->amax[a] > d->amin[a])
+			ev[i].value = (long long) (ev[i].value - d->amin[a]) *
+				AXISMAX * 2 / (d->amax[a] - d->amin[a]) - AXISMAX;
 	}
+}
 
-	memset(input, 0, sizeof(input));
-
-	int n = 0;
-	DIR *d = opendir("/dev/input");
-	if (d)
-	{
-		struct dirent *de;
-		while ((de = readdir(d)))
-		{
-			if (!strncmp(de->d_name, "event", 5) || !strncmp(de->d_name, "mouse", 5))
-			{
-				memset(&input[n], 0, sizeof(input[n]));
-				sprintf(input[n].devname, "/dev/input/%s", de->d_name);
-				int fd = open(input[n].devname, O_RDWR | O_CLOEXEC);
-				//printf("open(%s): %d\n", input[n].devname, fd);
-				//printf("open(%s): %d\n", input[n].name, fd);
-
-				if (fd > 0)
-				{
-					pool[n].fd = fd;
-					pool[n].events = POLLIN;
-					input[n].mouse = !strncmp(de->d_name, "mouse", 5);
-
-					char uniq[32] = {};
-					if (!input[n].mouse)
-					{
-						struct input_id id;
-						memset(&id, 0, sizeof(id));
-						ioctl(pool[n].fd, EVIOCGID, &id);
-						input[n].vid = id.vendor;
-						input[n].pid = id.product;
-
-						ioctl(pool[n].fd, EVIOCGUNIQ(sizeof(uniq)), uniq);
-						ioctl(pool[n].fd, EVIOCGNAME(sizeof(input[n].name)), input[n].name);
-						//input[n].led = has_led(pool[n].fd);
-					}
-
-					//skip our virtual device
-#if 0
-					if (!strcmp(input[n].name, UINPUT_NAME))
-					{
-						close(pool[n].fd);
-						pool[n].fd = -1;
-						//fprintf(stderr,"skipping MiSTer input\n");
-						continue;
-					}
-#endif
-
-					n++;
-					if (n >= NUMDEV) break;
-				}
-			}
-			
-		}
-		closedir(d);
-
-
+static int dev_find(char *name)
+{
+	int i;
+	for (i = 0; i < ndevs; i++)
+		if (devs[i].fd >= 0 && !strcmp(devs[i].name, name))
+			return i;
+	return -1;
+}
 
-		for (int i = 0; i < n; i++)
-		{
-			//printf("opened %d(%2d): %s (%04x:%04x) %d \"%s\" \"%s\"\n", i, input[i].bind, input[i].devname, input[i].vid, input[i].pid, input[i].quirk, input[i].id, input[i].name);
+/* open INPUTDIR/name if it is an event device with keys */
+static void dev_open(char *name)
+{
+	struct epoll_event ev;
+	char path[64];
+	struct dev *d;
+	int fd, i;
+	if (strncmp(name, "event", 5) || strlen(name) >= sizeof(devs[0].name) ||
+			dev_find(name) >= 0)
+		return;
+	snprintf(path, sizeof(path), "%s/%s", INPUTDIR, name);
+	if ((fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		return;
+	if (!dev_haskeys(fd)) {
+		close(fd);
+		return;
+	}
+	for (i = 0; i < ndevs && devs[i].fd >= 0; i++)
+		;
+	if (i == ndevs) {
+		int n = ndevs ? ndevs * 2 : 8;
+		if (!(d = realloc(devs, n * sizeof(devs[0])))) {
+			close(fd);
+			return;
 		}
-
+		devs = d;
+		for (; ndevs < n; ndevs++)
+			devs[ndevs].fd = -1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = ID_DEV + i;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		close(fd);
+		return;
 	}
+	devs[i].fd = fd;
+	strcpy(devs[i].name, name);
+	dev_axes(&devs[i]);
 }
 
-int read_input_devices(struct input_event *ev,int timeout)
+static void dev_close(int i)
 {
-	int return_value = poll(pool, NUMDEV + 3, timeout);
-	//fprintf(stderr,"return_value: %d\n",return_value);
-	if (!return_value) return -1;
+	epoll_ctl(efd, EPOLL_CTL_DEL, devs[i].fd, NULL);
+	close(devs[i].fd);
+	devs[i].fd = -1;
+}
 
-	if (return_value < 0)
-	{
-		//printf("ERR: poll\n");
-		return -1;
+/* handle devices appearing in or leaving INPUTDIR */
+static void dev_hotplug(void)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ie;
+	char *s;
+	int len, i;
+	while ((len = read(wfd, buf, sizeof(buf))) > 0) {
+		for (s = buf; s < buf + len; s += sizeof(*ie) + ie->len) {
+			ie = (void *) s;
+			if (!ie->len)
+				continue;
+			/* udev may make the node readable after creating it */
+			if (ie->mask & (IN_CREATE | IN_ATTRIB))
+				dev_open(ie->name);
+			if (ie->mask & IN_DELETE && (i = dev_find(ie->name)) >= 0)
+				dev_close(i);
+		}
 	}
+}
 
-	if ((pool[NUMDEV].revents & POLLIN) && check_devs())
-	{
-		//printf("Close all devices.\n");
-		for (int i = 0; i < NUMDEV; i++) if (pool[i].fd >= 0)
-		{
-			ioctl(pool[i].fd, EVIOCGRAB, 0);
-			close(pool[i].fd);
+int open_input_devices(void)
+{
+	struct epoll_event ev;
+	struct dirent *de;
+	DIR *dir;
+	if (efd < 0 && (efd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		return 1;
+	/* watch before listing, so that no device is missed */
+	if (wfd < 0 && (wfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = ID_WATCH;
+		if (inotify_add_watch(wfd, INPUTDIR, IN_CREATE | IN_ATTRIB | IN_DELETE) < 0 ||
+				epoll_ctl(efd, EPOLL_CTL_ADD, wfd, &ev) < 0) {
+			close(wfd);
+			wfd = -1;
 		}
-		return 0;
 	}
+	if ((dir = opendir(INPUTDIR))) {
+		while ((de = readdir(dir)))
+			dev_open(de->d_name);
+		closedir(dir);
+	}
+	return 0;
+}
 
-	for (int pos = 0; pos < NUMDEV; pos++)
-	{
-		int i = pos;
-		if ((pool[i].fd >= 0) && (pool[i].revents & POLLIN))
-		{
-			if (!input[i].mouse)
-			{
-				memset(ev, 0, sizeof(struct input_event));
-				if (read(pool[i].fd, ev, sizeof(struct input_event)) == sizeof(struct input_event))
-				{
-					/*
-					fprintf(stderr,"ev->code: %d ev->value %d ev->type %d\n",ev->code,ev->value,ev->type);
-
-					switch(ev->type)
-					{
-
-						case EV_SYN:
-							fprintf(stderr,"SYN: ev->code: %d\n",ev->code);
-  //- Used as markers to separate events. Events may be separated in time or in
-  //  space, such as with the multitouch protocol.
-						break;
-						case EV_MSC:
-							fprintf(stderr,"MSC: ev->code: %d\n",ev->code);
-  //- Used to describe miscellaneous input data that do not fit into other types.
-						break;
-						case EV_SW:
-							fprintf(stderr,"SW: ev->code: %d\n",ev->code);
-  //- Used to describe binary state input switches.
-						break;
-						case EV_LED:
-							fprintf(stderr,"LED: ev->code: %d\n",ev->code);
-  //- Used to turn LEDs on devices on and off.
-						break;
-						case EV_SND:
-							fprintf(stderr,"SND: ev->code: %d\n",ev->code);
-  //- Used to output sound to devices.
-						break;
-
-						case EV_REP:
-  //- Used for autorepeating devices.
-							fprintf(stderr,"REP: ev->code: %d\n",ev->code);
-						break;
-
-						case EV_FF:
-							fprintf(stderr,"FF: ev->code: %d\n",ev->code);
-  //- Used to send force feedback commands to an input device.
-						break;
-
-						case EV_PWR:
-							fprintf(stderr,"PWR: ev->code: %d\n",ev->code);
-  //- A special type for power button and switch input.
-						break;
+void close_input_devices(void)
+{
+	int i;
+	for (i = 0; i < ndevs; i++)
+		if (devs[i].fd >= 0)
+			dev_close(i);
+	free(devs);
+	devs = NULL;
+	ndevs = 0;
+	if (wfd >= 0)
+		close(wfd);
+	if (efd >= 0)
+		close(efd);
+	wfd = -1;
+	efd = -1;
+}
 
-						case EV_FF_STATUS:
-						//   - Used to receive force feedback device status.
-							fprintf(stderr,"FF_STATUS: ev->code: %d\n",ev->code);
-						break;
+/* watch fd too; read_input_devices() reports id (2 to 15) when it is readable */
+void add_input_fd(int id, int fd)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = id;
+	epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev);
+}
 
-						case EV_KEY:
-  //- Used to describe state changes of keyboards, buttons, or other key-like
-   // devices.
-							fprintf(stderr,"KEY: ev->code: %d\n",ev->code);
-						break;
-						case EV_ABS:
-							fprintf(stderr,"ABS: ev->code: %d\n",ev->code);
-  //- Used to describe absolute axis value changes, e.g. describing the
-   // coordinates of a touch on a touchscreen.
-						break;
-						case EV_REL:
-							fprintf(stderr,"REL: ev->code: %d\n",ev->code);
-  //- Used to describe relative axis value changes, e.g. moving the mouse 5 units
-  //  to the left.
-						break;
-					}
-					*/
-					int dev = i;
-					//fprintf(stderr,"got: %d\n",ev->type);
-					return 1;
-				}
-			}
+/*
+ * Wait for input and read the events of all ready devices at once.
+ * At most n events are stored in ev and their number is returned; the
+ * ids of the other descriptors that are readable are ORed into *ready
+ * as (1 << id).  Returns -1 on timeout.
+ */
+int read_input_devices(struct input_event *ev, int n, int *ready, int timeout)
+{
+	struct epoll_event evs[NREADY];
+	int cnt = 0;
+	int nready, i, len;
+	nready = epoll_wait(efd, evs, NREADY, timeout);
+	if (nready <= 0)
+		return -1;
+	for (i = 0; i < nready; i++) {
+		int id = evs[i].data.u64;
+		struct dev *d = id >= ID_DEV ? &devs[id - ID_DEV] : NULL;
+		if (id == ID_WATCH) {
+			dev_hotplug();
+			continue;
 		}
-
+		if (!d) {
+			*ready |= 1 << id;
+			continue;
+		}
+		/* the device may have been closed by dev_hotplug() */
+		if (d->fd < 0)
+			continue;
+		/* devices are non-blocking; read until they are empty or ev is full */
+		len = 0;
+		while (cnt < n) {
+			len = read(d->fd, ev + cnt, (n - cnt) * sizeof(*ev));
+			if (len <= 0)
+				break;
+			dev_scale(d, ev + cnt, len / sizeof(*ev));
+			cnt += len / sizeof(*ev);
+		}
+		/* unplugged without an inotify event yet */
+		if (len < 0 && errno == ENODEV)
+			dev_close(id - ID_DEV);
 	}
+	return cnt;
 }
 
 #if 0
 int main(int argc, char *argv[])
 {
-int err = open_input_devices();
-while (1) {
- struct input_event ev;
- err = read_input_devices(&ev,1000);
- if (err==1) {
-     fprintf(stderr,"ev.code: %d ev.value %d ev.type %d\n",ev.code,ev.value,ev.type);
-     if (ev.type==EV_KEY && ev.code==1) exit(0);
-
- }
-}
+	struct input_event ev;
+	int ready = 0;
+	open_input_devices();
+	while (1) {
+		if (read_input_devices(&ev, 1, &ready, 1000) == 1) {
+			fprintf(stderr, "ev.code: %d ev.value %d ev.type %d\n",
+				ev.code, ev.value, ev.type);
+			if (ev.type == EV_KEY && ev.code == 1)
+				exit(0);
+		}
+	}
 }
 #endif
@@ -1,8 +1,8 @@
 #include <linux/input.h>
-#include <sys/inotify.h>
 
-#include <sys/poll.h>
-#include <linux/input.h>
+#define AXISMAX		1000	/* EV_ABS values of sticks are scaled to +-AXISMAX */
 
-int open_input_devices();
-int read_input_devices(struct input_event *ev,int timeout);
+int open_input_devices(void);
+void close_input_devices(void);
+int read_input_devices(struct input_event *ev, int n, int *ready, int timeout);
+void add_input_fd(int id, int fd);
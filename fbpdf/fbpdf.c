@@ -22,30 +22,70 @@
 #include <string.h>
 #include <termios.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/inotify.h>
 #include <sys/select.h>
+#include <sys/timerfd.h>
 #include <fcntl.h>
 #include "draw.h"
 #include "doc.h"
+#include "job.h"
+#include "cache.h"
 #include "events.h"
+#include "index.h"
+#include "trace.h"
 
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
 #define MAX(a, b)	((a) > (b) ? (a) : (b))
+#define LEN(a)		(sizeof(a) / sizeof((a)[0]))
 
 #define PAGESTEPS	8
+#define PREVIEW		30	/* zoom level of page previews */
+#define NPREFETCH	4	/* number of prefetched neighbours */
+#define TILE		256	/* tile dimensions of large pages */
+#define PRIO_SIZE	3	/* job priorities */
+#define PRIO_PREVIEW	2
+#define PRIO_PAGE	1
+#define PRIO_PREFETCH	0
+#define PRIO_INDEX	-1
+#define RELOADWAIT	300	/* milliseconds without changes before reloading */
+#define NRELOAD		256	/* cached pages compared when reloading */
+#define IN_JOBS		2	/* read_input_devices() return values */
+#define IN_FILE		3
+#define IN_FRAME	4
+#define NSIDE		3	/* neighbours kept on each side in continuous mode */
+#define NTEXTTRY	3	/* attempts to extract the text of a page for the index */
+#define GAP		8	/* rows between pages in continuous mode */
+#define DEADZONE	150	/* stick deflection ignored, out of AXISMAX */
+#define STICKSPEED	24	/* frames to scroll a screen at full deflection */
+#define ACCEL		0.15	/* the part of the speed difference gained per frame */
+#define FRICTION	0.08	/* the part of the speed lost per frame after release */
 #define MAXZOOM		1000
 #define MARGIN		1
 #define CTRLKEY(x)	((x) - 96)
 #define ISMARK(x)	(isalpha(x) || (x) == '\'' || (x) == '`')
 
 static struct doc *doc;
-static fbval_t *pbuf;		/* current page */
+static int npages;		/* number of pages; zero until counted */
+static char *pbuf;		/* current page */
+static int bpp;			/* bytes per pixel of the framebuffer */
+static int gray;		/* pages are stored as gray levels */
+static int psz;			/* bytes per pixel of pages: bpp or 1 if gray */
+static struct ckey pkey;	/* cache key of pbuf */
+static int ppreview;		/* pbuf is a scaled up preview or NULL while loading */
 static int srows, scols;	/* screen dimentions */
 static int prows, pcols;	/* current page dimensions */
 static int prow, pcol;		/* page position */
 static int srow, scol;		/* screen position */
+static int pgen;		/* incremented whenever pbuf changes */
+static int dgen = -1, drow, dcol;	/* pgen, srow and scol at the last draw() */
+static int dclean;		/* the screen still shows the last draw() */
+static int dblbuf;		/* use double buffering */
 
 static struct termios termios;
 static char filename[256];
+static char *diskdir;		/* on-disk page cache directory */
+static char *tracefile;		/* write the recorded stages here on exit */
 static int mark[128];		/* mark page number */
 static int mark_row[128];	/* mark head position */
 static int num = 1;		/* page number */
@@ -56,48 +96,1103 @@ static int rotate;
 static int count;
 static int invert;		/* invert colors? */
 
+static struct job *pjob;	/* renders the current page */
+static struct job *ljob;	/* renders a preview of the current page */
+static struct job *sjob;	/* measures the current page */
+static struct job *rjob;	/* digests rpages[] in the reloaded document */
+static int rpages[NRELOAD];	/* cached pages to compare after reloading */
+static unsigned long long rold[NRELOAD];	/* their digests before reloading */
+static int nrpages;
+static unsigned long long *pdigest;	/* doc_digest() of the cached renders of each page */
+static int npdigest;
+static struct job *fjob[NPREFETCH];	/* measure or render the neighbouring pages */
+static struct ckey fkey[NPREFETCH];	/* cache keys of fjob[] */
+static int fsized[NPREFETCH];	/* fjob[] renders; the page was measured */
+static long fbytes[NPREFETCH];	/* the size of the page of fjob[] once measured */
+static int fprio[NPREFETCH];	/* the priority of fjob[] */
+static struct ckey fbig[NPREFETCH];	/* neighbours too large to prefetch */
+static int fbign;
+static int fdist[NPREFETCH] = {1, -1, 2, -2};	/* prefetched pages */
+
+static int ptiled;		/* the current page is too large; it is rendered in tiles */
+static int trows, tcols;	/* the number of tile rows and columns */
+static char **tbuf;		/* rendered tiles in or near the view */
+static struct job **tjob;	/* tiles being rendered */
+static int tdrow, tdcol;	/* direction of the last scroll */
+static int tsrow, tscol;	/* srow and scol at the last tileview() */
+static struct job *njob;	/* counts the pages */
+
+static int cont;		/* continuous mode: pages are shown one after another */
+static int sdir = 1;		/* the direction of the last page change */
+static struct side {
+	struct ckey key;	/* key.page is zero if the slot is empty */
+	char *buf;
+	int rows, cols;
+} side[NSIDE * 2];		/* pages num - NSIDE to num + NSIDE, except num */
+
+static struct job *xjob;	/* extracts the text of xpage for the index */
+static int xpage;
+static int xfails;		/* failed attempts to extract the text of xpage */
+static int xsaved;		/* the complete index was saved */
+static char sq[128];		/* the search query */
+static int sqedit;		/* the query is being typed */
+static struct hit {
+	int r0, c0, r1, c1;	/* the box of a matching word */
+	int id;			/* the number of the match on the page */
+} *hits;
+static int nhits;		/* the number of hits[] */
+static int hcnt;		/* the number of matches on the page */
+static int hcur = -1;		/* the current match */
+static struct ckey hkey;	/* the page hits[] belong to */
+static struct job *hjob;	/* extracts the text of hnext for the search */
+static struct ckey hnext;
+static int hdir;		/* the direction of the search; 0 if hjob only updates hits[] */
+static int hfrom;		/* the page the search started from */
+static int hstep;		/* the distance of hnext from hfrom */
+
+static int wfd = -1;		/* inotify descriptor watching the document */
+static long wtime;		/* the time of the last change to the document */
+
+static int tfd = -1;		/* timerfd pacing kinetic scrolling frames */
+static int tarmed;		/* tfd is running */
+static int axis[2];		/* stick deflection along ABS_X and ABS_Y */
+static double vrow, vcol;	/* scrolling speed in pixels per frame */
+static double frow, fcol;	/* fractions of a pixel not scrolled yet */
+static int ringtried;		/* fb_ring() was called */
+
+static int timing;		/* report startup times */
+static long t0;			/* start time */
+static long topen, tfb, tpixel, tpage, tcount;	/* milestones since t0 */
+
+/* monotonic time in milliseconds */
+static long mstime(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void tmark(long *t)
+{
+	if (!*t)
+		*t = MAX(1, mstime() - t0);
+}
+
+/* watch the directory of the document for new versions of it */
+static int watch_start(void)
+{
+	char dir[256];
+	char *slash = strrchr(filename, '/');
+	if (!slash)
+		strcpy(dir, ".");
+	else
+		snprintf(dir, sizeof(dir), "%.*s", (int) MAX(1, slash - filename), filename);
+	if ((wfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		return 1;
+	if (inotify_add_watch(wfd, dir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		close(wfd);
+		wfd = -1;
+		return 1;
+	}
+	return 0;
+}
+
+/* read pending inotify events; returns nonzero if the document changed */
+static int watch_read(void)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char *base = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+	struct inotify_event *ev;
+	int changed = 0;
+	int n, i;
+	while ((n = read(wfd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < n; i += sizeof(*ev) + ev->len) {
+			ev = (void *) (buf + i);
+			if (ev->len && !strcmp(ev->name, base))
+				changed = 1;
+		}
+	}
+	return changed;
+}
+
+/* page number and count for the status line */
+static char *pagestr(void)
+{
+	static char s[64];
+	if (npages)
+		snprintf(s, sizeof(s), "%d(%d)", num, npages);
+	else
+		snprintf(s, sizeof(s), "%d(?)", num);
+	return s;
+}
+
 static void printloading()
 {
 	printf("\x1b[H");
-	printf("LOADING:     file:%s  page:%d(%d)  zoom:%d%% \x1b[K\r",
-		filename, num, doc_pages(doc), zoom);
+	printf("LOADING:     file:%s  page:%s  zoom:%d%% \x1b[K\r",
+		filename, pagestr(), zoom);
 	fflush(stdout);
 }
+static void fillwhite(char *d, int n)
+{
+	fb_andxor(d, 0, FB_VAL(255, 255, 255), n);
+}
+
+/* copy n page pixels to the screen */
+static void drawpix(char *d, char *s, int n)
+{
+	if (gray)
+		fb_gray(d, s, n);
+	else
+		memcpy(d, s, n * bpp);
+}
+
+/* copy n pixels of page row row from tiles, starting at column col */
+static void drawtiles(char *d, int row, int col, int n)
+{
+	int tr = row / TILE;
+	while (n > 0) {
+		int tc = col / TILE;
+		int tw = MIN(TILE, pcols - tc * TILE);
+		int w = MIN(n, (tc + 1) * TILE - col);
+		char *t = tbuf[tr * tcols + tc];
+		if (t)
+			drawpix(d, t + ((row - tr * TILE) * tw + col - tc * TILE) * psz, w);
+		else
+			fillwhite(d, w);
+		d += w * bpp;
+		col += w;
+		n -= w;
+	}
+}
+
+/* highlight the matches of the search in row of the page, from col beg to end */
+static void drawhits(char *d, int row, int beg, int end)
+{
+	fbval_t hl = FB_VAL(255, 255, 0);
+	fbval_t hlcur = FB_VAL(255, 150, 0);
+	int i, c0, c1;
+	for (i = 0; i < nhits; i++) {
+		struct hit *h = &hits[i];
+		if (row < h->r0 || row >= h->r1)
+			continue;
+		c0 = MAX(beg, h->c0);
+		c1 = MIN(end, h->c1);
+		/* like a highlighter: dark text stays dark */
+		if (c0 < c1)
+			fb_andxor(d + (pcol + c0 - scol) * bpp,
+				h->id == hcur ? hlcur : hl, 0, c1 - c0);
+	}
+}
+
+/* the slot of page num + k in side[] */
+static struct side *sideat(int k)
+{
+	return &side[k < 0 ? NSIDE + k : NSIDE + k - 1];
+}
+
+/*
+ * In continuous mode, pages above and below the current one are laid
+ * out GAP rows apart.  Find the page at row i (in prow coordinates) of
+ * this strip; pages not rendered yet are assumed as high as the current
+ * one and are shown blank.  Returns nonzero for gaps and rows beyond
+ * the document or side[].
+ */
+static int stripat(int i, char **buf, int *top, int *rows, int *cols)
+{
+	int dir = i < prow ? -1 : 1;
+	int off = dir > 0 ? prow + prows + GAP : prow - GAP;
+	int k, r;
+	for (k = dir; abs(k) <= NSIDE; k += dir) {
+		struct side *sd = sideat(k);
+		if (num + k < 1 || (npages && num + k > npages))
+			return 1;
+		r = sd->buf ? sd->rows : prows;
+		if (dir > 0 ? i < off : i >= off)
+			return 1;
+		if (dir < 0)
+			off -= r;
+		if (i >= off && i < off + r) {
+			*buf = sd->buf;
+			*top = off;
+			*rows = r;
+			*cols = sd->buf ? sd->cols : pcols;
+			return 0;
+		}
+		off = dir > 0 ? off + r + GAP : off - GAP;
+	}
+	return 1;
+}
+
+/* copy screen row r from the page */
+static void drawrow(int r)
+{
+	char *dst = fb_mem(r);
+	int i = srow + r;
+	char *buf = pbuf;
+	int top = prow, rows = prows, cols = pcols, left = pcol;
+	int tiles = ptiled;
+	int cur = 1;
+	int cbeg, cend;
+	if (cont && (i < prow || i >= prow + prows)) {
+		if (stripat(i, &buf, &top, &rows, &cols))
+			rows = 0;
+		left = -cols / 2;
+		tiles = 0;
+		cur = 0;
+	}
+	cbeg = MAX(scol, left);
+	cend = MIN(scol + scols, left + cols);
+	if (i < top || i >= top + rows || cbeg >= cend) {
+		memset(dst, 0, scols * bpp);
+		return;
+	}
+	memset(dst, 0, (cbeg - scol) * bpp);
+	if (buf)
+		drawpix(dst + (cbeg - scol) * bpp,
+			buf + ((long) (i - top) * cols + cbeg - left) * psz,
+			cend - cbeg);
+	else if (tiles)
+		drawtiles(dst + (cbeg - scol) * bpp, i - top,
+			cbeg - left, cend - cbeg);
+	else
+		fillwhite(dst + (cbeg - scol) * bpp, cend - cbeg);
+	if (cur && nhits && !memcmp(&hkey, &pkey, sizeof(pkey)))
+		drawhits(dst, i - prow, cbeg - pcol, cend - pcol);
+	memset(dst + (cend - scol) * bpp, 0, (scol + scols - cend) * bpp);
+}
+
+static void tileview(void);
+static void searchpage(int p);
+
 static void draw(void)
 {
-	int bpp = FBM_BPP(fb_mode());
+	int d = srow - drow;
+	long long beg = trace_now(), fbeg;
+	int i;
+	if (ptiled)
+		tileview();
+	/* the page is shown at another zoom or rotation */
+	if (sq[0] && !hjob && hkey.page == num && memcmp(&hkey, &pkey, sizeof(pkey))) {
+		hdir = 0;
+		searchpage(num);
+	}
+	if (dgen == pgen && dcol == scol && !d)
+		return;
+	if (dgen == pgen && dcol == scol && dclean && abs(d) < srows) {
+		/* vertical scroll: move what is already there */
+		fb_scroll(d);
+		for (i = d > 0 ? srows - d : 0; i < (d > 0 ? srows : -d); i++)
+			drawrow(i);
+	} else {
+		for (i = 0; i < srows; i++)
+			drawrow(i);
+	}
+	fbeg = trace_now();
+	if (fb_flip()) {
+		/* double buffering was given up; draw on the visible screen */
+		for (i = 0; i < srows; i++)
+			drawrow(i);
+		fb_flip();
+	}
+	trace_add(TR_FLIP, num, fbeg);
+	trace_add(TR_DRAW, num, beg);
+	if (pbuf)
+		tmark(&tpixel);
+	if (pbuf && !ppreview)
+		tmark(&tpage);
+	dgen = pgen;
+	drow = srow;
+	dcol = scol;
+	dclean = 1;
+}
+
+static void pageinvert(char *buf, int n)
+{
+	int i;
+	if (!gray) {
+		fb_andxor(buf, ~0u, FB_VAL(255, 255, 255) ^ FB_VAL(0, 0, 0), n);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		buf[i] = ~buf[i];
+}
+
+/* collect the page rendered by job; the job is freed */
+/* the digest of the cached renders of page; 0 if unknown */
+static unsigned long long digestget(int page)
+{
+	return page < npdigest ? pdigest[page] : 0;
+}
+
+static void digestset(int page, unsigned long long digest)
+{
+	unsigned long long *d;
+	int n = npdigest;
+	if (page >= npdigest) {
+		n = MAX(page + 1, npdigest * 2);
+		if (!(d = realloc(pdigest, n * sizeof(d[0]))))
+			return;
+		memset(d + npdigest, 0, (n - npdigest) * sizeof(d[0]));
+		pdigest = d;
+		npdigest = n;
+	}
+	pdigest[page] = digest;
+}
+
+/* should the cached render at key be replaced? */
+static int pagestale(struct ckey *key)
+{
+	/* until rjob tells, pages cached before reloading may have changed */
+	return rjob || cache_isstale(key);
+}
+
+/* take the render of page key->page and note its digest */
+static char *pagetake(struct job *job, struct ckey *key, int *rows, int *cols)
+{
+	unsigned long long digest = job_pagedigest(job);
+	char *buf = job_take(job, rows, cols);
+	long long beg = trace_now();
+	if (buf && digest)
+		digestset(key->page, digest);
+	if (buf && key->invert) {
+		pageinvert(buf, *rows * *cols);
+		trace_add(TR_INVERT, num, beg);
+	}
+	return buf;
+}
+
+/* the tile row or column containing page pixel off */
+static int tilepos(int off)
+{
+	return off < 0 ? -1 : off / TILE;
+}
+
+/* load the tiles in view and the next ones in the direction of scroll */
+static void tileview(void)
+{
+	int rbeg = MAX(0, tilepos(srow - prow));
+	int rend = MIN(trows - 1, tilepos(srow + srows - 1 - prow));
+	int cbeg = MAX(0, tilepos(scol - pcol));
+	int cend = MIN(tcols - 1, tilepos(scol + scols - 1 - pcol));
+	struct ckey key = pkey;
+	int r, c, t, seen, near, stale;
+	int rows, cols, crows, ccols;
+	if (srow != tsrow)
+		tdrow = srow > tsrow ? 1 : -1;
+	if (scol != tscol)
+		tdcol = scol > tscol ? 1 : -1;
+	tsrow = srow;
+	tscol = scol;
+	for (r = 0; r < trows; r++) {
+		for (c = 0; c < tcols; c++) {
+			t = r * tcols + c;
+			rows = MIN(TILE, prows - r * TILE);
+			cols = MIN(TILE, pcols - c * TILE);
+			seen = r >= rbeg && r <= rend && c >= cbeg && c <= cend;
+			near = r >= rbeg - (tdrow < 0) && r <= rend + (tdrow > 0) &&
+				c >= cbeg - (tdcol < 0) && c <= cend + (tdcol > 0);
+			key.tile = t + 1;
+			if (!near) {
+				if (tbuf[t])
+					cache_put(&key, tbuf[t], rows, cols,
+						(long) rows * cols * psz);
+				job_cancel(tjob[t]);
+				tbuf[t] = NULL;
+				tjob[t] = NULL;
+				continue;
+			}
+			if (tbuf[t])
+				continue;
+			if (tjob[t]) {
+				job_prio(tjob[t], seen ? PRIO_PAGE : PRIO_PREFETCH);
+				continue;
+			}
+			stale = pagestale(&key);
+			if ((tbuf[t] = cache_get(&key, &crows, &ccols))) {
+				pgen++;
+				if (!stale)
+					continue;
+			}
+			tjob[t] = job_tile(doc, pkey.page, pkey.zoom, pkey.rotate,
+				r * TILE, c * TILE, rows, cols,
+				seen ? PRIO_PAGE : PRIO_PREFETCH);
+		}
+	}
+}
+
+/* render the current page in tiles */
+static void tilestart(void)
+{
+	ptiled = 1;
+	trows = (prows + TILE - 1) / TILE;
+	tcols = (pcols + TILE - 1) / TILE;
+	tbuf = calloc(trows * tcols, sizeof(tbuf[0]));
+	tjob = calloc(trows * tcols, sizeof(tjob[0]));
+	if (!tbuf || !tjob) {
+		free(tbuf);
+		free(tjob);
+		tbuf = NULL;
+		tjob = NULL;
+		ptiled = 0;
+	}
+	tdrow = 1;
+	tdcol = 0;
+	tsrow = srow;
+	tscol = scol;
+}
+
+/* move the tiles of the current page to the cache */
+static void tilefree(void)
+{
+	struct ckey key = pkey;
+	int rows, cols;
+	int t;
+	for (t = 0; ptiled && t < trows * tcols; t++) {
+		key.tile = t + 1;
+		rows = MIN(TILE, prows - t / tcols * TILE);
+		cols = MIN(TILE, pcols - t % tcols * TILE);
+		if (tbuf[t])
+			cache_put(&key, tbuf[t], rows, cols,
+				(long) rows * cols * psz);
+		job_cancel(tjob[t]);
+	}
+	free(tbuf);
+	free(tjob);
+	tbuf = NULL;
+	tjob = NULL;
+	ptiled = 0;
+}
+
+/* return the neighbours held in side[] to the cache */
+static void sideflush(void)
+{
+	int i;
+	for (i = 0; i < LEN(side); i++) {
+		if (side[i].buf)
+			cache_put(&side[i].key, side[i].buf, side[i].rows, side[i].cols,
+				(long) side[i].rows * side[i].cols * psz);
+		side[i].buf = NULL;
+		side[i].key.page = 0;
+	}
+}
+
+/* take the rendered neighbours of the current page from the cache */
+static int sidefill(void)
+{
+	struct side *sd;
+	struct ckey key;
+	int changed = 0;
+	int k;
+	for (k = -NSIDE; k <= NSIDE; k++) {
+		if (!k)
+			continue;
+		sd = sideat(k);
+		key = pkey;
+		key.page = num + k;
+		if (sd->buf && !memcmp(&sd->key, &key, sizeof(key)))
+			continue;
+		if (sd->buf)
+			cache_put(&sd->key, sd->buf, sd->rows, sd->cols,
+				(long) sd->rows * sd->cols * psz);
+		sd->buf = NULL;
+		sd->key.page = 0;
+		/* stale pages stay in the cache to be rendered again */
+		if (!cache_has(&key) || pagestale(&key))
+			continue;
+		if ((sd->buf = cache_get(&key, &sd->rows, &sd->cols))) {
+			sd->key = key;
+			changed = 1;
+		}
+	}
+	if (changed)
+		pgen++;
+	return changed;
+}
+
+static int fbighas(struct ckey *key)
+{
+	int i;
+	for (i = 0; i < NPREFETCH && i < fbign; i++)
+		if (!memcmp(&fbig[i], key, sizeof(*key)))
+			return 1;
+	return 0;
+}
+
+static int sidehas(struct ckey *key)
+{
+	int i;
+	for (i = 0; i < LEN(side); i++)
+		if (side[i].buf && !memcmp(&side[i].key, key, sizeof(*key)))
+			return 1;
+	return 0;
+}
+
+/* render the neighbours of the current page that fit in the cache */
+static void prefetch(void)
+{
+	static int fdown[NPREFETCH] = {1, 2, 3, -1};
+	static int fup[NPREFETCH] = {-1, -2, -3, 1};
+	/* in continuous mode, render ahead in the reading direction */
+	int *dist = !cont ? fdist : (sdir > 0 ? fdown : fup);
+	long size = (long) prows * pcols * psz;
+	struct ckey key;
+	int i, j;
+	for (i = 0; i < NPREFETCH; i++) {
+		for (j = 0; fjob[i] && j < NPREFETCH; j++) {
+			key = pkey;
+			key.page += dist[j];
+			if (!memcmp(&key, &fkey[i], sizeof(key)))
+				break;
+		}
+		/* leave room for the prefetched pages and the previous page */
+		if (fjob[i] && (j == NPREFETCH || (j + 2) * size > cache_size())) {
+			job_cancel(fjob[i]);
+			fjob[i] = NULL;
+		}
+	}
+	for (j = 0; j < NPREFETCH && (j + 2) * size <= cache_size(); j++) {
+		key = pkey;
+		key.page += dist[j];
+		if (key.page < 1 || (npages && key.page > npages) ||
+				(cache_has(&key) && !cache_isstale(&key)) ||
+				sidehas(&key) || disk_has(&key) || fbighas(&key))
+			continue;
+		for (i = 0; i < NPREFETCH; i++)
+			if (fjob[i] && !memcmp(&key, &fkey[i], sizeof(key)))
+				break;
+		if (i < NPREFETCH)
+			continue;
+		for (i = 0; fjob[i]; i++)
+			;
+		fkey[i] = key;
+		/* the next page is likely on the screen in continuous mode */
+		fprio[i] = cont && !j ? PRIO_PAGE : PRIO_PREFETCH;
+		/* neighbours are measured first; they may need tiles */
+		fsized[i] = 0;
+		fjob[i] = job_size(doc, key.page, key.zoom, key.rotate, fprio[i]);
+	}
+}
+
+/*
+ * The neighbour measured by fjob[i] is rendered, unless it needs tiles
+ * or does not fit beside the current, the previous and the other
+ * prefetched pages.
+ */
+static void prefetch_sized(int i)
+{
+	long room = cache_size() - (long) prows * pcols * psz * 2;
+	int rows, cols;
+	int j;
+	job_take(fjob[i], &rows, &cols);
+	fjob[i] = NULL;
+	fbytes[i] = (long) rows * cols * psz;
+	if (fbytes[i] * 2 > cache_size()) {
+		fbig[fbign++ % NPREFETCH] = fkey[i];
+		return;
+	}
+	for (j = 0; j < NPREFETCH; j++)
+		if (j != i && fjob[j] && fsized[j])
+			room -= fbytes[j];
+	if (fbytes[i] > room)
+		return;
+	fsized[i] = 1;
+	fjob[i] = job_start(doc, fkey[i].page, fkey[i].zoom, fkey[i].rotate, fprio[i]);
+}
+
+/* scale up a preview to the size of the page at zoom */
+static char *upscale(char *src, int rows, int cols, int *prows, int *pcols)
+{
+	char *dst;
+	int r = rows * zoom / PREVIEW;
+	int c = cols * zoom / PREVIEW;
+	int i, j;
+	if (!(dst = malloc((long) r * c * psz)))
+		return NULL;
+	for (i = 0; i < r; i++) {
+		char *s = src + (long) (i * rows / r) * cols * psz;
+		char *d = dst + (long) i * c * psz;
+		if (psz == 4)
+			for (j = 0; j < c; j++)
+				((uint32_t *) d)[j] = ((uint32_t *) s)[j * cols / c];
+		else if (psz == 2)
+			for (j = 0; j < c; j++)
+				((uint16_t *) d)[j] = ((uint16_t *) s)[j * cols / c];
+		else if (psz == 1)
+			for (j = 0; j < c; j++)
+				d[j] = s[j * cols / c];
+		else
+			for (j = 0; j < c; j++)
+				memcpy(d + j * psz, s + j * cols / c * psz, psz);
+	}
+	*prows = r;
+	*pcols = c;
+	return dst;
+}
+
+/* replace the preview or the blank page being shown with buf */
+static void showpage(char *buf, int rows, int cols, int preview)
+{
+	int top = srow - prow;
+	free(pbuf);
+	pbuf = buf;
+	prows = rows;
+	pcols = cols;
+	ppreview = preview;
+	pgen++;
+	prow = -prows / 2;
+	pcol = -pcols / 2;
+	srow = prow + top;
+}
+
+static int loadpage(int p);
+
+/* the number of pages; waits for njob if they are not counted yet */
+static int pagecount(void)
+{
+	char path[1024];
+	int rows, cols;
+	if (njob) {
+		job_take(njob, &rows, &cols);
+		njob = NULL;
+		npages = rows;
+		tmark(&tcount);
+		/* the index of the document may be saved from an earlier run */
+		xsaved = !disk_file(path, sizeof(path), "idx") && !idx_load(path, npages);
+		if (!xsaved)
+			idx_reset(npages);
+	}
+	return npages;
+}
+
+/* extract the text of the next page not in the index in the background */
+static void indexnext(void)
+{
+	if (xjob || njob || !npages)
+		return;
+	if (!(xpage = idx_todo(num))) {
+		if (!xsaved)
+			disk_save("idx", idx_save);
+		xsaved = 1;
+		return;
+	}
+	xjob = job_text(doc, xpage, 100, 0, PRIO_INDEX);
+}
+
+/* find the matches of the search among the n words of the page at key */
+static int hitsfind(struct ckey *key, struct dword *words, int n)
+{
+	char q[16][IDXWORD];
+	char w[IDXWORD];
+	struct hit *h;
+	int nq = idx_terms(sq, q, 16);
+	int *idx;
+	int m = 0;
+	int i, j;
+	free(hits);
+	hits = NULL;
+	nhits = 0;
+	hcnt = 0;
+	hcur = -1;
+	hkey = *key;
+	if (hkey.page == num)
+		pgen++;
+	if (!nq || !words)
+		return 0;
+	/* the words that are not only punctuation */
+	if (!(idx = malloc(n * sizeof(idx[0]))) ||
+			!(hits = malloc(n * sizeof(hits[0])))) {
+		free(idx);
+		return 0;
+	}
+	for (i = 0; i < n; i++)
+		if (idx_norm(w, words[i].s))
+			idx[m++] = i;
+	for (i = 0; i + nq <= m; i++) {
+		for (j = 0; j < nq; j++) {
+			idx_norm(w, words[idx[i + j]].s);
+			if (strcmp(w, q[j]))
+				break;
+		}
+		if (j < nq)
+			continue;
+		for (j = 0; j < nq; j++) {
+			h = &hits[nhits++];
+			h->r0 = words[idx[i + j]].r0;
+			h->c0 = words[idx[i + j]].c0;
+			h->r1 = words[idx[i + j]].r1;
+			h->c1 = words[idx[i + j]].c1;
+			h->id = hcnt;
+		}
+		hcnt++;
+		i += nq - 1;
+	}
+	free(idx);
+	return hcnt;
+}
+
+/* scroll to the current match */
+static void hitshow(void)
+{
+	int i;
+	for (i = 0; i < nhits && hits[i].id != hcur; i++)
+		;
+	if (i == nhits)
+		return;
+	if (hits[i].r0 < srow - prow || hits[i].r1 > srow - prow + srows)
+		srow = prow + hits[i].r0 - srows / 3;
+	if (pcols > scols && (hits[i].c0 < scol - pcol || hits[i].c1 > scol - pcol + scols))
+		scol = pcol + hits[i].c0 - scols / 3;
+	pgen++;
+}
+
+/* extract the text of page p in the background; pagejobs() finds its hits */
+static void searchpage(int p)
+{
+	job_cancel(hjob);
+	hnext = pkey;
+	hnext.page = p;
+	hjob = job_text(doc, p, hnext.zoom, hnext.rotate, PRIO_SIZE);
+}
+
+static void searchnotfound(void)
+{
+	hdir = 0;
+	printf("\x1b[H/%s: not found\x1b[K\r", sq);
+	fflush(stdout);
+	dclean = 0;
+}
+
+/* search the pages at least step pages away from hfrom */
+static void searchfrom(int step)
+{
+	int p;
+	/* the index rules out most pages without extracting their text */
+	for (; step <= pagecount(); step++) {
+		p = ((hfrom - 1 + hdir * step) % npages + npages) % npages + 1;
+		if (idx_has(p) && !idx_match(p, sq))
+			continue;
+		hstep = step;
+		searchpage(p);
+		return;
+	}
+	searchnotfound();
+}
+
+/* the hits of the page hstep pages away from hfrom are found */
+static void searchon(void)
+{
+	if (hstep ? !hcnt : hcur + hdir < 0 || hcur + hdir >= hcnt) {
+		searchfrom(hstep + 1);
+		return;
+	}
+	hcur = hstep ? (hdir > 0 ? 0 : hcnt - 1) : hcur + hdir;
+	hdir = 0;
+	if (hkey.page != num) {
+		loadpage(hkey.page);
+		srow = prow;
+	}
+	hitshow();
+}
+
+/* jump to the next match of the search in direction dir */
+static void searchnext(int dir)
+{
+	char q[16][IDXWORD];
+	if (!sq[0])
+		return;
+	if (!idx_terms(sq, q, 16)) {
+		searchnotfound();
+		return;
+	}
+	hdir = dir;
+	hfrom = num;
+	hstep = 0;
+	/* the matches on the current page come first */
+	if (memcmp(&hkey, &pkey, sizeof(pkey)))
+		searchpage(num);
+	else
+		searchon();
+}
+
+/* render the current page, measured as rows x cols, as a whole or in tiles */
+static void pagestart(int rows, int cols)
+{
+	int top = srow - prow;
+	/* the blank page takes the size of the page */
+	prows = rows;
+	pcols = cols;
+	pgen++;
+	prow = -prows / 2;
+	pcol = -pcols / 2;
+	srow = prow + top;
+	/* pages larger than half the cache are rendered in tiles */
+	if ((long) rows * cols * psz * 2 > cache_size()) {
+		ppreview = 0;
+		tilestart();
+		return;
+	}
+	pjob = job_start(doc, pkey.page, pkey.zoom, pkey.rotate, PRIO_PAGE);
+	if (pkey.zoom >= PREVIEW * 2)
+		ljob = job_start(doc, pkey.page, PREVIEW, pkey.rotate, PRIO_PREVIEW);
+}
+
+/*
+ * Compare the cached pages with the new version of the document.  The
+ * digests noted when the pages were rendered are compared with those
+ * of the new version in rjob, on the rendering thread; pages without
+ * a digest are rendered again.
+ */
+static void reloadstale(void)
+{
+	int n, i;
+	nrpages = 0;
+	if ((n = cache_pages(rpages, LEN(rpages))) < 0) {
+		cache_stale(0);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		if (rpages[i] == num || !digestget(rpages[i])) {
+			cache_stale(rpages[i]);
+			continue;
+		}
+		rold[nrpages] = digestget(rpages[i]);
+		rpages[nrpages++] = rpages[i];
+	}
+	/* after the current page, which is always rendered again */
+	if (nrpages && !(rjob = job_digest(doc, rpages, nrpages, PRIO_PREFETCH)))
+		cache_stale(0);
+}
+
+/* mark the pages that rjob found drawn differently */
+static void reloaddone(void)
+{
+	unsigned long long *digest;
+	int rows, cols;
+	int i;
+	digest = job_take(rjob, &rows, &cols);
+	rjob = NULL;
+	for (i = 0; i < nrpages; i++) {
+		if (!digest || !digest[i] || digest[i] != rold[i]) {
+			cache_stale(rpages[i]);
+			/* no render of the page is fresh */
+			digestset(rpages[i], 0);
+		}
+	}
+	free(digest);
+}
+
+/* collect finished jobs; returns nonzero if pbuf has changed */
+static int pagejobs(void)
+{
+	char *buf, *big;
+	int rows, cols;
+	int ret = 0;
 	int i;
-	fbval_t *rbuf = malloc(scols * sizeof(rbuf[0]));
-	for (i = srow; i < srow + srows; i++) {
-		int cbeg = MAX(scol, pcol);
-		int cend = MIN(scol + scols, pcol + pcols);
-		memset(rbuf, 0, scols * sizeof(rbuf[0]));
-		if (i >= prow && i < prow + prows && cbeg < cend) {
-			memcpy(rbuf + cbeg - scol,
-				pbuf + (i - prow) * pcols + cbeg - pcol,
-				(cend - cbeg) * sizeof(rbuf[0]));
+	if (sjob && job_done(sjob)) {
+		job_take(sjob, &rows, &cols);
+		sjob = NULL;
+		pagestart(rows, cols);
+		ret = 1;
+	}
+	if (pjob && job_done(pjob)) {
+		buf = pagetake(pjob, &pkey, &rows, &cols);
+		pjob = NULL;
+		if (buf) {
+			job_cancel(ljob);
+			ljob = NULL;
+			disk_put(&pkey, buf, rows, cols, (long) rows * cols * psz);
+			showpage(buf, rows, cols, 0);
+			ret = 1;
+		}
+	}
+	if (ljob && job_done(ljob)) {
+		buf = pagetake(ljob, &pkey, &rows, &cols);
+		ljob = NULL;
+		if (buf && (big = upscale(buf, rows, cols, &rows, &cols))) {
+			showpage(big, rows, cols, 1);
+			ret = 1;
+		}
+		free(buf);
+	}
+	for (i = 0; ptiled && i < trows * tcols; i++) {
+		if (tjob[i] && job_done(tjob[i])) {
+			/* tbuf[i] may hold the tile of an older version of the file */
+			if ((buf = pagetake(tjob[i], &pkey, &rows, &cols))) {
+				free(tbuf[i]);
+				tbuf[i] = buf;
+			}
+			tjob[i] = NULL;
+			tmark(&tpixel);
+			pgen++;
+			ret = 1;
+		}
+	}
+	if (rjob && job_done(rjob)) {
+		reloaddone();
+		/* stale neighbours are rendered again; fresh ones are shown */
+		prefetch();
+		if (cont)
+			sidefill();
+		ret = 1;
+	}
+	if (njob && job_done(njob)) {
+		/* the page asked for may not exist */
+		if (pagecount() && num > npages && !loadpage(npages)) {
+			srow = prow;
+			ret = 1;
+		}
+		prefetch();
+		indexnext();
+	}
+	if (xjob && job_done(xjob)) {
+		struct dword *words = job_take(xjob, &rows, &cols);
+		xjob = NULL;
+		/* a page is tried again before it is left out of the index */
+		if (words) {
+			idx_add(xpage, words, rows);
+			xfails = 0;
+		} else if (++xfails >= NTEXTTRY) {
+			idx_fail(xpage);
+			xfails = 0;
 		}
-		memcpy(fb_mem(i - srow), rbuf, scols * bpp);
+		free(words);
+		indexnext();
 	}
-	free(rbuf);
+	if (hjob && job_done(hjob)) {
+		struct dword *words = job_take(hjob, &rows, &cols);
+		hjob = NULL;
+		if (words && !idx_has(hnext.page))
+			idx_add(hnext.page, words, rows);
+		hitsfind(&hnext, words, rows);
+		free(words);
+		if (hdir)
+			searchon();
+		ret = 1;
+	}
+	for (i = 0; i < NPREFETCH; i++) {
+		if (fjob[i] && !fsized[i] && job_done(fjob[i]))
+			prefetch_sized(i);
+		if (fjob[i] && fsized[i] && job_done(fjob[i])) {
+			buf = pagetake(fjob[i], &fkey[i], &rows, &cols);
+			fjob[i] = NULL;
+			disk_put(&fkey[i], buf, rows, cols,
+				(long) rows * cols * psz);
+			cache_put(&fkey[i], buf, rows, cols,
+				(long) rows * cols * psz);
+			if (cont && sidefill())
+				ret = 1;
+		}
+	}
+	return ret;
 }
 
+/* cancel all rendering jobs */
+static void pagejobs_cancel(void)
+{
+	int i;
+	tilefree();
+	job_cancel(njob);
+	njob = NULL;
+	job_cancel(xjob);
+	xjob = NULL;
+	xfails = 0;
+	job_cancel(hjob);
+	hjob = NULL;
+	hdir = 0;
+	job_cancel(pjob);
+	job_cancel(ljob);
+	job_cancel(sjob);
+	pjob = NULL;
+	ljob = NULL;
+	sjob = NULL;
+	/* the pages not compared yet cannot be trusted */
+	if (rjob)
+		cache_stale(0);
+	job_cancel(rjob);
+	rjob = NULL;
+	for (i = 0; i < NPREFETCH; i++) {
+		job_cancel(fjob[i]);
+		fjob[i] = NULL;
+	}
+	fbign = 0;
+}
+
+/*
+ * Switch to page p; it is shown blank until rendered.  Pages neither
+ * cached nor prefetched are measured first on the rendering thread, to
+ * decide whether to render them in tiles; meanwhile the blank page has
+ * the size of the previous one.
+ */
 static int loadpage(int p)
 {
+	struct ckey key = {p, zoom, rotate, invert};
+	char *buf;
+	int rows = pkey.zoom ? prows * zoom / pkey.zoom : 0;
+	int cols = pkey.zoom ? pcols * zoom / pkey.zoom : 0;
+	int stale;
+	long long beg = trace_now();
 	int i;
-	if (p < 1 || p > doc_pages(doc))
+	if (p < 1 || (npages && p > npages))
 		return 1;
-	prows = 0;
-	free(pbuf);
+	sideflush();
+	if (ppreview || !pbuf)
+		free(pbuf);
+	else
+		cache_put(&pkey, pbuf, prows, pcols, (long) prows * pcols * psz);
+	pbuf = NULL;
+	tilefree();
+	job_cancel(pjob);
+	job_cancel(ljob);
+	job_cancel(sjob);
+	pjob = NULL;
+	ljob = NULL;
+	sjob = NULL;
 	num = p;
-	printloading();
-	pbuf = doc_draw(doc, p, zoom, rotate, &prows, &pcols);
-	if (invert) {
-		for (i = 0; i < prows * pcols; i++)
-			pbuf[i] = pbuf[i] ^ 0xffffffff;
+	pkey = key;
+	ppreview = 0;
+	/* a prefetch of this page may be under way */
+	for (i = 0; i < NPREFETCH; i++)
+		if (fjob[i] && !memcmp(&key, &fkey[i], sizeof(key)))
+			break;
+	stale = pagestale(&key);
+	if ((buf = cache_get(&key, &rows, &cols))) {
+		pbuf = buf;
+		/* show the old version until the page is rendered again */
+		if (stale) {
+			ppreview = 1;
+			pjob = job_start(doc, p, zoom, rotate, PRIO_PAGE);
+		}
+	} else if ((buf = disk_get(&key, &rows, &cols))) {
+		pbuf = buf;
+	} else if (i < NPREFETCH && fsized[i]) {
+		printloading();
+		ppreview = 1;
+		pjob = fjob[i];
+		fjob[i] = NULL;
+		job_prio(pjob, PRIO_PAGE);
+	} else if (i < NPREFETCH) {
+		/* the page is being measured */
+		printloading();
+		ppreview = 1;
+		sjob = fjob[i];
+		fjob[i] = NULL;
+		job_prio(sjob, PRIO_SIZE);
+	} else {
+		printloading();
+		ppreview = 1;
+		if (!(sjob = job_size(doc, p, zoom, rotate, PRIO_SIZE)))
+			pagestart(rows, cols);
 	}
+	prows = pbuf || ppreview ? rows : 0;
+	pcols = cols;
+	pgen++;
 	prow = -prows / 2;
 	pcol = -pcols / 2;
+	prefetch();
+	if (cont)
+		sidefill();
+	trace_add(TR_LOAD, p, beg);
 	return 0;
 }
 
@@ -147,9 +1242,23 @@ static int getcount(int def)
 
 static void printinfo(void)
 {
+	struct cstat st;
+	struct dstat ds;
+	char stats[512];
+	cache_stat(&st);
 	printf("\x1b[H");
-	printf("FBPDF:     file:%s  page:%d(%d)  zoom:%d%% \x1b[K\r",
-		filename, num, doc_pages(doc), zoom);
+	printf("FBPDF:     file:%s  page:%s  zoom:%d%%  "
+		"cache:%ldM/%ldM  hit:%ld  miss:%ld  evict:%ld",
+		filename, pagestr(), zoom,
+		st.size >> 20, cache_size() >> 20,
+		st.hits, st.misses, st.evicts);
+	if (doc && !doc_stat(doc, &ds))
+		printf("  lists:%ldM/%ldM  hit:%ld%%",
+			ds.size >> 20, ds.limit >> 20,
+			ds.hits * 100 / MAX(1, ds.hits + ds.misses));
+	/* average and maximum milliseconds of the recent stages */
+	trace_stats(stats, sizeof(stats));
+	printf(" \x1b[K\n%s\x1b[K\r\x1b[A", stats);
 	fflush(stdout);
 }
 
@@ -173,31 +1282,67 @@ static void term_cleanup(void)
 	printf("\x1b[?25h\n");		/* show the cursor */
 }
 
+static volatile sig_atomic_t contd;	/* SIGCONT arrived; the console was reset */
+
 static void sigcont(int sig)
 {
-	term_setup();
+	contd = 1;
 }
 
 static int reload(void)
 {
-	doc_close(doc);
-	doc = doc_open(filename);
-	if (!doc || !doc_pages(doc)) {
+	struct doc *ndoc = doc_open(filename);
+	/* the file may be incomplete; keep the old one until the next change */
+	if (!ndoc) {
 		fprintf(stderr, "\nfbpdf: cannot open <%s>\n", filename);
 		return 1;
 	}
+	/* the rendering thread stays; only the jobs of the old file go */
+	pagejobs_cancel();
+	job_flush();
+	/* old pages are shown until rendered again */
+	if (pbuf && !ppreview)
+		cache_put(&pkey, pbuf, prows, pcols, (long) prows * pcols * psz);
+	else
+		free(pbuf);
+	pbuf = NULL;
+	ppreview = 1;
+	sideflush();
+	doc_close(doc);
+	doc = ndoc;
+	reloadstale();
+	npages = 0;
+	idx_reset(0);
+	hkey.page = 0;
+	nhits = 0;
+	hcnt = 0;
+	hcur = -1;
+	/* the file has changed; so has its hash */
+	disk_close();
+	if (diskdir)
+		disk_open(diskdir, filename, gray ? 0 : fb_mode());
 	if (!loadpage(num))
 		draw();
+	njob = job_pages(doc, PRIO_PAGE);
 	return 0;
 }
 
+/* is the pixel at p white? pixels are little-endian, like fb_conv()'s */
+static int iswhite(char *p)
+{
+	fbval_t white = FB_VAL(255, 255, 255);
+	if (gray)
+		return (unsigned char) *p == 255;
+	return !memcmp(p, &white, bpp);
+}
+
 static int rmargin(void)
 {
 	int ret = 0;
 	int i, j;
 	for (i = 0; i < prows; i++) {
 		j = pcols - 1;
-		while (j > ret && pbuf[i * pcols + j] == FB_VAL(255, 255, 255))
+		while (j > ret && iswhite(pbuf + ((long) i * pcols + j) * psz))
 			j--;
 		if (ret < j)
 			ret = j;
@@ -211,7 +1356,7 @@ static int lmargin(void)
 	int i, j;
 	for (i = 0; i < prows; i++) {
 		j = 0;
-		while (j < ret && pbuf[i * pcols + j] == FB_VAL(255, 255, 255))
+		while (j < ret && iswhite(pbuf + ((long) i * pcols + j) * psz))
 			j++;
 		if (ret > j)
 			ret = j;
@@ -511,254 +1656,458 @@ uint32_t get_ps2_code(uint16_t key)
 	return ev2ps2[key];
 }
 
-static void mainloop_new(void)
+/* in continuous mode, make the page at the top of the screen current */
+static void stripmove(void)
 {
-    int step = srows / PAGESTEPS;
-    int hstep = scols / PAGESTEPS;
-    int done=0;
-
-    struct timeval nowtime;
+	int off;
+	while (cont) {
+		if (srow >= prow + prows && (!npages || num < npages)) {
+			off = srow - (prow + prows + GAP);
+			if (loadpage(num + 1))
+				break;
+			srow = prow + off;
+			sdir = 1;
+		} else if (srow < prow - GAP && num > 1) {
+			off = srow - prow;
+			if (loadpage(num - 1))
+				break;
+			srow = prow + prows + GAP + off;
+			sdir = -1;
+		} else {
+			break;
+		}
+	}
+}
 
-    term_setup();
-    signal(SIGCONT, sigcont);
+/* the first and last values of srow; continuous mode only stops at the ends */
+static int srowmin(int margin)
+{
+	return cont && num > 1 ? srow : prow - margin;
+}
 
-    loadpage(num);
-    srow = prow;
-    scol = -scols / 2;
-    draw();
+static int srowmax(int margin)
+{
+	return cont && (!npages || num < npages) ? srow : prow + prows - srows + margin;
+}
 
-    int err = open_input_devices();
+/* the scrolling speed for stick deflection v, from -1 to 1 */
+static double stickspeed(int v)
+{
+	double x = (double) (abs(v) - DEADZONE) / (AXISMAX - DEADZONE);
+	if (x <= 0)
+		return 0;
+	/* quadratic for finer control near the centre */
+	return v < 0 ? -x * x : x * x;
+}
 
-    // default to width
-    zoom_page(pcols ? zoom * scols / pcols : zoom);
-    draw();
+/* move the speed towards the stick's; glide to a stop if it is released */
+static double speedstep(double v, double target)
+{
+	v += (target - v) * (target ? ACCEL : FRICTION);
+	return v > -0.25 && v < 0.25 && !target ? 0 : v;
+}
 
-    while (!done) {
-      struct input_event ev;
-      err = read_input_devices(&ev,1000);
-      if (err==1) {
-         //fprintf(stderr,"ev.code: %d ev.value %d ev.type %d\n",ev.code,ev.value,ev.type);
-     	 if (ev.type==EV_ABS) {
-//
-// REMOVE THE ABS code, because mister sends us arrow keys for the joystick, all nicely mapped
-#if 0
-		 // code is the axis
-		 // value is the y direction
-                if (ev.code==1) {
-                    if (ev.value>110 || ev.value<-110) {
-                         if (ev.value>110)
-                            srow += step * getcount(1);
-                         if (ev.value<-110){
-                            srow -= step * getcount(1);
-			   }
-
-			 // try to make us lock to the viewport
-			 if (srow < prow) srow=prow;
-			 if (prow+srow>-srows) srow = prows - srows+ prow;
-		    }
-               } else if (ev.code==0) {
-		       if (ev.value>110 || ev.value<-110) {
-
-                        if (ev.value>110)
-                            scol += hstep * getcount(1);
-                        if (ev.value<-110)
-                            scol -= hstep * getcount(1);
-
-			 if (scol < pcol) scol=pcol;
-			 if (pcol+scol>-scols) scol = pcols - scols+ pcol;
-                   }
-               }
-#endif
-	 } else if (ev.type==EV_KEY) {
+/* run or stop the frame timer */
+static void frametimer(int on)
+{
+	struct itimerspec it;
+	if (tfd < 0 || on == tarmed)
+		return;
+	memset(&it, 0, sizeof(it));
+	if (on) {
+		it.it_interval.tv_nsec = 1000000000 / fb_hz();
+		it.it_value = it.it_interval;
+	}
+	timerfd_settime(tfd, 0, &it, NULL);
+	tarmed = on;
+}
 
-		 if (ev.code <256) {
-			uint32_t ps2code = get_ps2_code(ev.code);
-			if (ev.value) modifier |= ps2code;
-			else modifier &= ~ps2code;
-		 }
+/* advance kinetic scrolling by n frames; returns nonzero while moving */
+static int scrollframes(int n)
+{
+	int d;
+	while (n-- > 0) {
+		vrow = speedstep(vrow, stickspeed(axis[1]) * srows / STICKSPEED);
+		/* narrow pages stay centred */
+		if (pcols > scols)
+			vcol = speedstep(vcol, stickspeed(axis[0]) * scols / STICKSPEED);
+		frow += vrow;
+		fcol += vcol;
+		d = frow;
+		srow += d;
+		frow -= d;
+		d = fcol;
+		scol += d;
+		fcol -= d;
+	}
+	stripmove();
+	/* stop at the edges of the page */
+	if (srow < srowmin(0) || srow > srowmax(0)) {
+		srow = MAX(srowmin(0), MIN(srowmax(0), srow));
+		vrow = 0;
+		frow = 0;
+	}
+	if (pcols > scols && (scol < pcol || scol > pcol + pcols - scols)) {
+		scol = MAX(pcol, MIN(pcol + pcols - scols, scol));
+		vcol = 0;
+		fcol = 0;
+	}
+	return vrow || vcol || stickspeed(axis[0]) || stickspeed(axis[1]);
+}
 
+/* move n pages forward or backward, stopping at the first or last page */
+static void pagestep(int n)
+{
+	int p = MAX(1, num + n);
+	if (npages)
+		p = MIN(npages, p);
+	if (p != num && !loadpage(p))
+		srow = prow;
+}
 
-		int shift = (get_key_mod() & LSHIFT) || (get_key_mod() & RSHIFT);
-                int ctrl  = (get_key_mod() & (LCTRL | RCTRL));
-		 // ev.code >= 256 are joystick buttons
-		
-		 //  Check time
-	         gettimeofday(&nowtime,NULL);
-		 struct timeval result;
-		timersub(&nowtime,&ev.time,&result);
-		double time_in_mill = (result.tv_sec)*1000+(result.tv_usec)/1000;
-		if (time_in_mill < 500)
-		 switch (ev.code) {
-			 case KEY_HOME:
-                         if (!loadpage(1  ))
-                                srow = prow;
-			 break;
-			 case KEY_END:
-                         if (!loadpage(getcount(doc_pages(doc) ) ))
-                                srow = prow;
-			 break;
-			 case KEY_ENTER:  
-			 	if (shift) {  // previous screen
-					srow = prow;
-				}
-				else {  // next screen
-					srow = prow + prows - srows;
-				}
-			 break;
-			 case KEY_ESC:  // ESC
-				 done=1;
-			 break;
-			case KEY_UP:
-			 	if (shift && ctrl) {
-                         	   if (!loadpage(1  ))
-                               	 	srow = prow;
-
-				} else { // up arrow - scroll up
-                            	    srow -= step * getcount(1);
-
-					 // try to make us lock to the viewport
-			 	    if (srow < prow) srow=prow;
-				}
-			 break;
-			case KEY_DOWN:
-			 	if (shift && ctrl) {
-                         		if (!loadpage(getcount(doc_pages(doc) ) ))
-                               	 		srow = prow;
-
-				} else { // up arrow - scroll up
-	                            srow += step * getcount(1);
-
-					 // try to make us lock to the viewport
-				    if (prow+srow>-srows) srow = prows - srows+ prow;
-				}
-			 break;
-			case KEY_LEFT:
-#if 0
-                            scol -= hstep * getcount(1);
+/* the character typed by key code on a US layout, or zero */
+static int keychar(int code, int shift)
+{
+	static char *rows[][2] = {
+		{"1234567890-=", "!@#$%^&*()_+"},
+		{"qwertyuiop[]", "QWERTYUIOP{}"},
+		{"asdfghjkl;'`", "ASDFGHJKL:\"~"},
+		{"\\zxcvbnm,./", "|ZXCVBNM<>?"},
+	};
+	static int first[] = {KEY_1, KEY_Q, KEY_A, KEY_BACKSLASH};
+	int i;
+	if (code == KEY_SPACE)
+		return ' ';
+	for (i = 0; i < LEN(first); i++)
+		if (code >= first[i] && code < first[i] + strlen(rows[i][0]))
+			return rows[i][shift != 0][code - first[i]];
+	return 0;
+}
 
-			     if (scol < pcol) scol=pcol;
-			     if (pcol+scol>-scols) scol = pcols - scols+ pcol;
-#else
-                             if (!loadpage(num - getcount(1)))
-                                 srow = prow;
-#endif
-			 break;
-			case KEY_RIGHT:
-#if 0
-                            scol += hstep * getcount(1);
-			     if (scol < pcol) scol=pcol;
-		   	    if (pcol+scol>-scols) scol = pcols - scols+ pcol;
-#else
+static void searchprompt(void)
+{
+	printf("\x1b[H/%s\x1b[K\r", sq);
+	fflush(stdout);
+	dclean = 0;
+}
 
-                             if (!loadpage(num + getcount(1)))
-                                 srow = prow;
-#endif
-			 break;
-			case KEY_PAGEUP:
-			 	if (shift && ctrl) {
-                         		if (!loadpage(1  ))
-                               	 		srow = prow;
-
-				}
-				else if (ctrl) {
-                        	     if (!loadpage(num - getcount(1)))
-                               		  srow = prow;
-				}  else {
-					srow = prow;
-				}
-			break;
-			case KEY_PAGEDOWN:
-				if (shift & ctrl) {
-                         		if (!loadpage(getcount(doc_pages(doc) ) ))
-                                		srow = prow;
-				} else if (ctrl) {
-                             	   if (!loadpage(num + getcount(1)))
-                                 	srow = prow;
-				} else {
-					srow = prow + prows - srows;
-				}
-			break;
-			case KEY_MINUS:
-				if (ctrl) {
-				   zoom_page(zoom - 75);
-				}
-			break;
-			case KEY_EQUAL:
-			 	if (ctrl) {
-				   zoom_page(zoom + 75);
-				}
-			break;
+/* edit the search query while it is being typed */
+static void searchkey(int code, int n, int shift)
+{
+	int len = strlen(sq);
+	int c = keychar(code, shift);
+	switch (code) {
+	case KEY_ENTER:
+		sqedit = 0;
+		/* search the current page from its top */
+		hkey.page = 0;
+		hcur = -1;
+		searchnext(1);
+		return;
+	case KEY_ESC:
+		sqedit = 0;
+		sq[0] = '\0';
+		job_cancel(hjob);
+		hjob = NULL;
+		hdir = 0;
+		hkey.page = 0;
+		nhits = 0;
+		pgen++;
+		return;
+	case KEY_BACKSPACE:
+		sq[MAX(0, len - n)] = '\0';
+		break;
+	default:
+		while (c && n-- > 0 && len + 1 < sizeof(sq))
+			sq[len++] = c;
+		sq[len] = '\0';
+	}
+	searchprompt();
+}
 
+/* execute the command of key code, repeated n times; returns 1 to quit */
+static int keycmd(int code, int n, int shift, int ctrl)
+{
+	int step = srows / PAGESTEPS;
+	if (sqedit) {
+		searchkey(code, n, shift);
+		return 0;
+	}
+	switch (code) {
+	case KEY_HOME:
+		if (!loadpage(1))
+			srow = prow;
+		break;
+	case KEY_END:
+		if (!loadpage(getcount(pagecount())))
+			srow = prow;
+		break;
+	case KEY_ENTER:
+		if (shift)		/* previous screen */
+			srow = prow;
+		else			/* next screen */
+			srow = prow + prows - srows;
+		break;
+	case KEY_ESC:
+		return 1;
+	case KEY_E:
+		reload();
+		break;
+	case KEY_I:
+		printinfo();
+		dclean = 0;
+		break;
+	case KEY_SLASH:
+		sqedit = 1;
+		sq[0] = '\0';
+		searchprompt();
+		break;
+	case KEY_N:
+		while (n-- > 0)
+			searchnext(shift ? -1 : 1);
+		break;
+	case KEY_C:
+		cont = !cont;
+		if (cont)
+			sidefill();
+		else
+			sideflush();
+		pgen++;
+		break;
+	case KEY_UP:
+		if (shift && ctrl) {
+			if (!loadpage(1))
+				srow = prow;
+		} else {
+			srow -= step * n * getcount(1);
+			/* try to make us lock to the viewport */
+			if (srow < srowmin(0))
+				srow = srowmin(0);
+		}
+		break;
+	case KEY_DOWN:
+		if (shift && ctrl) {
+			if (!loadpage(getcount(pagecount())))
+				srow = prow;
+		} else {
+			srow += step * n * getcount(1);
+			/* try to make us lock to the viewport */
+			if (!cont && prow + srow > -srows)
+				srow = prows - srows + prow;
+		}
+		break;
+	case KEY_LEFT:
+		pagestep(-n * getcount(1));
+		break;
+	case KEY_RIGHT:
+		pagestep(n * getcount(1));
+		break;
+	case KEY_PAGEUP:
+		if (shift && ctrl) {
+			if (!loadpage(1))
+				srow = prow;
+		} else if (ctrl) {
+			pagestep(-n * getcount(1));
+		} else if (cont) {
+			srow -= (srows - step) * n;
+		} else {
+			srow = prow;
+		}
+		break;
+	case KEY_PAGEDOWN:
+		if (shift && ctrl) {
+			if (!loadpage(getcount(pagecount())))
+				srow = prow;
+		} else if (ctrl) {
+			pagestep(n * getcount(1));
+		} else if (cont) {
+			srow += (srows - step) * n;
+		} else {
+			srow = prow + prows - srows;
+		}
+		break;
+	case KEY_MINUS:
+		if (ctrl)
+			zoom_page(zoom - 75 * n);
+		break;
+	case KEY_EQUAL:
+		if (ctrl)
+			zoom_page(zoom + 75 * n);
+		break;
 #if 0
 // remove this code, because we are going to use <esc> and <enter> sent by the mister
 // all nicely mapped
-			// https://elixir.bootlin.com/linux/latest/source/include/uapi/linux/input-event-codes.h#L381
-                         case BTN_A:
-                             if (!loadpage(num + getcount(1)))
-                                 srow = prow;
-                         break;
-                         case BTN_B:
-                             if (!loadpage(num - getcount(1)))
-                                 srow = prow;
-                         break;
-                         case BTN_X:
-                             if (!loadpage(num + getcount(10)))
-                                 srow = prow;
-                         break;
-                         case BTN_Y:
-                             if (!loadpage(num - getcount(10)))
-                                 srow = prow;
-                         break;
-                         case BTN_TL:
-                             zoom_page(prows ? zoom * srows / prows : zoom);
-                         break;
-                         case BTN_TR:
-                             zoom_page(pcols ? zoom * scols / pcols : zoom);
-                         break;
-			 case BTN_SELECT:
-			 	rotate = rotate +90;
-				if (rotate>=360) rotate=0;
-				if (!loadpage(num))
-					srow = prow;
-				break;
-				/*
-			 case BTN_TR2:
-			 	rotate = rotate -90;
-				if (!loadpage(num))
-					srow = prow;
-				break;
-				*/
+	// https://elixir.bootlin.com/linux/latest/source/include/uapi/linux/input-event-codes.h#L381
+	case BTN_A:
+		pagestep(n * getcount(1));
+		break;
+	case BTN_B:
+		pagestep(-n * getcount(1));
+		break;
+	case BTN_X:
+		pagestep(n * getcount(10));
+		break;
+	case BTN_Y:
+		pagestep(-n * getcount(10));
+		break;
+	case BTN_TL:
+		zoom_page(prows ? zoom * srows / prows : zoom);
+		break;
+	case BTN_TR:
+		zoom_page(pcols ? zoom * scols / pcols : zoom);
+		break;
+	case BTN_SELECT:
+		rotate = rotate + 90;
+		if (rotate >= 360)
+			rotate = 0;
+		if (!loadpage(num))
+			srow = prow;
+		break;
 #endif
+	}
+	return 0;
+}
+
+#define NEVENTS		256	/* input events read at once */
+
+static void mainloop_new(void)
+{
+    struct input_event ev[NEVENTS];
+    int done=0;
+    int i, n;
+
+    term_setup();
+    signal(SIGCONT, sigcont);
+
+    // default to width; measure the page first to render it only once
+    {
+        int rows = 0, cols = 0;
+        job_take(job_size(doc, num, zoom, rotate, PRIO_SIZE), &rows, &cols);
+        if (cols)
+            zoom = MIN(MAXZOOM, MAX(50, zoom * scols / cols));
+    }
+    loadpage(num);
+    srow = prow;
+    scol = -scols / 2;
+    draw();
+    /* count the pages once the first page is on its way */
+    njob = job_pages(doc, PRIO_PAGE);
+
+    open_input_devices();
+    add_input_fd(IN_JOBS, job_fd());
+    if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) >= 0)
+        add_input_fd(IN_FRAME, tfd);
+    if (!watch_start())
+        add_input_fd(IN_FILE, wfd);
+
+    while (!done) {
+      int ready = 0;
+      /* the pending key command and the number of its repeats */
+      int kcode = -1, kcount = 0, kshift = 0, kctrl = 0;
+      long long beg;
+      n = read_input_devices(ev, NEVENTS, &ready, wtime ? RELOADWAIT : 1000);
+      beg = trace_now();
+      /* term_setup() clears the console, and the page with it */
+      if (contd) {
+         contd = 0;
+         term_setup();
+         dclean = 0;
+         dgen = -1;
+      }
+      if ((ready & (1 << IN_FILE)) && watch_read())
+         wtime = mstime();
+      /* reload once the file has not changed for a while */
+      if (wtime && mstime() - wtime >= RELOADWAIT) {
+         wtime = 0;
+         reload();
+      }
+      if (ready & (1 << IN_JOBS)) {
+         uint64_t cnt;
+         read(job_fd(), &cnt, sizeof(cnt));
+         pagejobs();
+      }
+      if (ready & (1 << IN_FRAME)) {
+         uint64_t cnt = 0;
+         read(tfd, &cnt, sizeof(cnt));
+         /* catch up with missed frames, but not after long stalls */
+         if (!scrollframes(MIN(cnt, 8)))
+            frametimer(0);
+      }
+      /*
+       * Handle the whole batch before drawing: key presses and
+       * autorepeats of the same key are folded into one command,
+       * so that a held key does not fall behind slow renders.
+       */
+      for (i = 0; i < n && !done; i++) {
+     	 if (ev[i].type==EV_ABS) {
+		/* sticks set the scrolling speed; see scrollframes() */
+		if (ev[i].code == ABS_X || ev[i].code == ABS_Y)
+			axis[ev[i].code == ABS_Y] = ev[i].value;
+	 } else if (ev[i].type==EV_KEY) {
+		int shift, ctrl;
+		 // ev.code >= 256 are joystick buttons
+		 if (ev[i].code <256) {
+			uint32_t ps2code = get_ps2_code(ev[i].code);
+			if (ev[i].value) modifier |= ps2code;
+			else modifier &= ~ps2code;
 		 }
+		/* releases only update the modifiers */
+		if (!ev[i].value)
+			continue;
+		shift = (get_key_mod() & LSHIFT) || (get_key_mod() & RSHIFT);
+		ctrl  = (get_key_mod() & (LCTRL | RCTRL)) != 0;
+		if (ev[i].code == kcode && shift == kshift && ctrl == kctrl) {
+			kcount++;
+			continue;
+		}
+		if (kcount)
+			done = keycmd(kcode, kcount, kshift, kctrl);
+		kcode = ev[i].code;
+		kcount = 1;
+		kshift = shift;
+		kctrl = ctrl;
 	 }
-	srow = MAX(prow - srows + MARGIN, MIN(prow + prows - MARGIN, srow));
-	scol = MAX(pcol - scols + MARGIN, MIN(pcol + pcols - MARGIN, scol));
-
-	draw();
-	
-     }
+      }
+      if (kcount && !done)
+	done = keycmd(kcode, kcount, kshift, kctrl);
+      if (stickspeed(axis[0]) || stickspeed(axis[1])) {
+	/* scroll sticks by panning the display, if the driver allows */
+	if (!dblbuf && !ringtried++ && !fb_ring())
+		dgen = -1;
+	frametimer(1);
+      }
+      stripmove();
+      srow = MAX(srowmin(srows - MARGIN), MIN(srowmax(srows - MARGIN), srow));
+      scol = MAX(pcol - scols + MARGIN, MIN(pcol + pcols - MARGIN, scol));
+      /* the time from reading the events to the start of draw() */
+      if (n > 0)
+         trace_add(TR_INPUT, n, beg);
+      draw();
    }
 
+   if (tfd >= 0)
+      close(tfd);
+   close_input_devices();
    term_cleanup();
 
 }
 
 static char *usage =
-	"usage: fbpdf [-r rotation] [-z zoom x10] [-p page] filename";
+	"usage: fbpdf [-r rotation] [-z zoom x10] [-p page] [-m cache MB] [-b] [-t threads] [-l lists MB] [-d cache dir] [-D dir MB] [-T] [-M] [-c] [-g] [-P trace] filename";
 
 int main(int argc, char *argv[])
 {
+	int pnum = 0;		/* -p was given */
 	int i = 1;
+	t0 = mstime();
 	if (argc < 2) {
 		puts(usage);
 		return 1;
 	}
 	strcpy(filename, argv[argc - 1]);
-	doc = doc_open(filename);
-	if (!doc || !doc_pages(doc)) {
-		fprintf(stderr, "fbpdf: cannot open <%s>\n", filename);
-		return 1;
-	}
+	if (getenv("FBPDF_CACHE"))
+		cache_limit(atol(getenv("FBPDF_CACHE")) << 20);
+	diskdir = getenv("FBPDF_DISK");
 	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
 		switch (argv[i][1]) {
 		case 'r':
@@ -769,22 +2118,89 @@ int main(int argc, char *argv[])
 			break;
 		case 'p':
 			num = atoi(argv[i][2] ? argv[i] + 2 : argv[++i]);
+			pnum = 1;
+			break;
+		case 'd':
+			diskdir = argv[i][2] ? argv[i] + 2 : argv[++i];
+			break;
+		case 'D':
+			disk_limit(atol(argv[i][2] ? argv[i] + 2 : argv[++i]) << 20);
+			break;
+		case 'm':
+			cache_limit(atol(argv[i][2] ? argv[i] + 2 : argv[++i]) << 20);
+			break;
+		case 'b':
+			dblbuf = 1;
+			break;
+		case 't':
+			doc_threads(atoi(argv[i][2] ? argv[i] + 2 : argv[++i]));
+			break;
+		case 'l':
+			doc_cache(atol(argv[i][2] ? argv[i] + 2 : argv[++i]) << 20);
+			break;
+		case 'T':
+			timing = 1;
+			break;
+		case 'M':
+			doc_preload(1);
+			break;
+		case 'c':
+			cont = 1;
+			break;
+		case 'g':
+			gray = 1;
+			break;
+		case 'P':
+			tracefile = argv[i][2] ? argv[i] + 2 : argv[++i];
 			break;
 		}
 	}
-	printinfo();
+	/* the page count is left to the rendering thread */
 	if (fb_init(getenv("FBDEV")))
 		return 1;
+	tmark(&tfb);
+	bpp = FBM_BPP(fb_mode());
+	psz = gray ? 1 : bpp;
+	doc_gray(gray);
+	if (dblbuf && fb_dblbuf())
+		fprintf(stderr, "fbpdf: double buffering is not available\n");
 	srows = fb_rows();
 	scols = fb_cols();
-	if (FBM_BPP(fb_mode()) != sizeof(fbval_t))
-		fprintf(stderr, "fbpdf: fbval_t doesn't match fb depth\n");
-	else{
+	doc = doc_open(filename);
+	tmark(&topen);
+	if (!doc) {
+		fb_free();
+		fprintf(stderr, "fbpdf: cannot open <%s>\n", filename);
+		return 1;
+	}
+	printinfo();
+	if (diskdir && disk_open(diskdir, filename, gray ? 0 : fb_mode()))
+		fprintf(stderr, "fbpdf: cannot use <%s> for caching\n", diskdir);
+	/* resume where the document was left if no page is given */
+	if (!pnum && disk_lastpage() > 0)
+		num = disk_lastpage();
+	if (bpp < 2)
+		fprintf(stderr, "fbpdf: unsupported framebuffer depth\n");
+	else if (job_init())
+		fprintf(stderr, "fbpdf: cannot start the rendering thread\n");
+	else {
 		mainloop_new();
+		sideflush();
+		pagejobs_cancel();
+		job_free();
+		disk_setpage(num);
 	}
+	disk_close();
 	fb_free();
 	free(pbuf);
+	cache_clear();
 	if (doc)
 		doc_close(doc);
+	if (tracefile && trace_dump(tracefile))
+		fprintf(stderr, "fbpdf: cannot write <%s>\n", tracefile);
+	if (timing)
+		fprintf(stderr, "fbpdf: framebuffer %ldms  open %ldms  first pixel %ldms  "
+			"first page %ldms  page count %ldms\n",
+			tfb, topen, tpixel, tpage, tcount);
 	return 0;
 }
@@ -0,0 +1,44 @@
+/* document files read into memory at once */
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "doc.h"
+#include "fload.h"
+
+static int preload;		/* doc_preload() argument */
+
+void doc_preload(int on)
+{
+	preload = on;
+}
+
+/*
+ * Read the file at path into a malloc()ed buffer if doc_preload() was
+ * enabled; NULL otherwise.  The file is copied rather than mapped: a
+ * document being rewritten in place would be truncated under a mapping
+ * and any access to it would raise SIGBUS.
+ */
+void *fload(char *path, long *len)
+{
+	struct stat st;
+	char *buf;
+	long n = 0, r;
+	int fd;
+	if (!preload || (fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) || st.st_size <= 0 || !(buf = malloc(st.st_size))) {
+		close(fd);
+		return NULL;
+	}
+	/* usually a single read */
+	while (n < st.st_size && (r = read(fd, buf + n, st.st_size - n)) > 0)
+		n += r;
+	close(fd);
+	if (n < st.st_size) {
+		free(buf);
+		return NULL;
+	}
+	*len = n;
+	return buf;
+}
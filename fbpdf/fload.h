@@ -0,0 +1,2 @@
+/* documents read into memory (fload.c) */
+void *fload(char *path, long *len);
@@ -0,0 +1,317 @@
+/* inverted index of the words of the document */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "doc.h"
+#include "index.h"
+
+#define MAGIC		0x78696266	/* "fbix" */
+
+struct term {
+	char *s;		/* normalized word; NULL for empty slots */
+	int *pages;		/* the pages containing the word in ascending order */
+	int n, sz;
+};
+
+static struct term *terms;	/* open addressing hash table */
+static int tsz;			/* the size of terms[]; a power of two */
+static int tcnt;		/* the number of terms */
+static char *done;		/* done[p] is 1 if page p is indexed, 2 if it failed */
+static int npages;
+
+static unsigned idx_hash(char *s)
+{
+	unsigned h = 2166136261u;
+	while (*s)
+		h = (h ^ (unsigned char) *s++) * 16777619u;
+	return h;
+}
+
+static struct term *idx_slot(char *s)
+{
+	unsigned i = idx_hash(s) & (tsz - 1);
+	while (terms[i].s && strcmp(terms[i].s, s))
+		i = (i + 1) & (tsz - 1);
+	return &terms[i];
+}
+
+static struct term *idx_find(char *s)
+{
+	struct term *t;
+	if (!tsz)
+		return NULL;
+	t = idx_slot(s);
+	return t->s ? t : NULL;
+}
+
+static int idx_grow(void)
+{
+	struct term *old = terms;
+	int osz = tsz;
+	int i;
+	tsz = tsz ? tsz * 2 : 1024;
+	if (!(terms = calloc(tsz, sizeof(terms[0])))) {
+		terms = old;
+		tsz = osz;
+		return 1;
+	}
+	for (i = 0; i < osz; i++)
+		if (old[i].s)
+			*idx_slot(old[i].s) = old[i];
+	free(old);
+	return 0;
+}
+
+/* the entry of word s, added if missing */
+static struct term *idx_term(char *s)
+{
+	struct term *t;
+	if ((tcnt + 1) * 2 > tsz && idx_grow())
+		return NULL;
+	t = idx_slot(s);
+	if (!t->s) {
+		if (!(t->s = strdup(s)))
+			return NULL;
+		tcnt++;
+	}
+	return t;
+}
+
+static int idx_addpage(struct term *t, int page)
+{
+	int *pages;
+	int i = t->n;
+	/* pages mostly arrive in order */
+	while (i > 0 && t->pages[i - 1] > page)
+		i--;
+	if (i > 0 && t->pages[i - 1] == page)
+		return 0;
+	if (t->n == t->sz) {
+		int sz = t->sz ? t->sz * 2 : 4;
+		if (!(pages = realloc(t->pages, sz * sizeof(pages[0]))))
+			return 1;
+		t->pages = pages;
+		t->sz = sz;
+	}
+	memmove(t->pages + i + 1, t->pages + i, (t->n - i) * sizeof(t->pages[0]));
+	t->pages[i] = page;
+	t->n++;
+	return 0;
+}
+
+static int idx_haspage(struct term *t, int page)
+{
+	int l = 0, h = t->n;
+	while (l < h) {
+		int m = (l + h) / 2;
+		if (t->pages[m] == page)
+			return 1;
+		if (t->pages[m] < page)
+			l = m + 1;
+		else
+			h = m;
+	}
+	return 0;
+}
+
+/* clear the index of a document with the given number of pages */
+int idx_reset(int n)
+{
+	int i;
+	for (i = 0; i < tsz; i++) {
+		free(terms[i].s);
+		free(terms[i].pages);
+	}
+	free(terms);
+	free(done);
+	terms = NULL;
+	done = NULL;
+	tsz = 0;
+	tcnt = 0;
+	npages = 0;
+	if (n > 0 && !(done = calloc(n + 1, 1)))
+		return 1;
+	npages = n;
+	return 0;
+}
+
+int idx_has(int page)
+{
+	return page >= 1 && page <= npages && done[page] == 1;
+}
+
+/* the text of page could not be extracted; it is not indexed again */
+void idx_fail(int page)
+{
+	if (page >= 1 && page <= npages && !done[page])
+		done[page] = 2;
+}
+
+/* the first page not indexed nor failed, starting from page from; zero if none */
+int idx_todo(int from)
+{
+	int i;
+	for (i = 0; i < npages; i++) {
+		int p = (from - 1 + i) % npages + 1;
+		if (!done[p])
+			return p;
+	}
+	return 0;
+}
+
+/* lower-case letters and digits of src; punctuation is dropped */
+int idx_norm(char *dst, char *src)
+{
+	int n = 0;
+	for (; *src; src++) {
+		unsigned char c = *src;
+		/* do not cut UTF-8 sequences */
+		int len = c >= 0xf0 ? 4 : (c >= 0xe0 ? 3 : (c >= 0xc0 ? 2 : 1));
+		if (n + len > IDXWORD - 1)
+			break;
+		if (c >= 0x80 || isalnum(c))
+			dst[n++] = tolower(c);
+	}
+	dst[n] = '\0';
+	return n;
+}
+
+void idx_add(int page, struct dword *words, int n)
+{
+	char s[IDXWORD];
+	struct term *t;
+	int i;
+	if (page < 1 || page > npages)
+		return;
+	for (i = 0; i < n; i++)
+		if (idx_norm(s, words[i].s) && (t = idx_term(s)))
+			idx_addpage(t, page);
+	done[page] = 1;
+}
+
+/* split query into at most max normalized words */
+int idx_terms(char *query, char (*terms)[IDXWORD], int max)
+{
+	char w[IDXWORD * 4];
+	int n = 0, len;
+	while (*query && n < max) {
+		while (*query == ' ')
+			query++;
+		for (len = 0; *query && *query != ' '; query++)
+			if (len < sizeof(w) - 1)
+				w[len++] = *query;
+		w[len] = '\0';
+		if (idx_norm(terms[n], w))
+			n++;
+	}
+	return n;
+}
+
+/* does page contain all words of query? */
+int idx_match(int page, char *query)
+{
+	char q[16][IDXWORD];
+	struct term *t;
+	int n = idx_terms(query, q, 16);
+	int i;
+	for (i = 0; i < n; i++)
+		if (!(t = idx_find(q[i])) || !idx_haspage(t, page))
+			return 0;
+	return n > 0;
+}
+
+static void putnum(FILE *fp, unsigned n)
+{
+	while (n >= 0x80) {
+		fputc((n & 0x7f) | 0x80, fp);
+		n >>= 7;
+	}
+	fputc(n, fp);
+}
+
+static int getnum(FILE *fp, unsigned *n)
+{
+	int c, s = 0;
+	*n = 0;
+	do {
+		if ((c = fgetc(fp)) == EOF || s > 28)
+			return 1;
+		*n |= (c & 0x7f) << s;
+		s += 7;
+	} while (c & 0x80);
+	return 0;
+}
+
+/*
+ * Save the index of a completely indexed document.  Words are written
+ * with their page numbers delta-encoded as varints.
+ */
+int idx_save(char *path)
+{
+	char tmp[1100];
+	FILE *fp;
+	int i, j, ret;
+	if (!npages)
+		return 1;
+	for (i = 1; i <= npages; i++)
+		if (done[i] != 1)
+			return 1;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (!(fp = fopen(tmp, "w")))
+		return 1;
+	putnum(fp, MAGIC);
+	putnum(fp, npages);
+	putnum(fp, tcnt);
+	for (i = 0; i < tsz; i++) {
+		struct term *t = &terms[i];
+		if (!t->s)
+			continue;
+		putnum(fp, strlen(t->s));
+		fputs(t->s, fp);
+		putnum(fp, t->n);
+		for (j = 0; j < t->n; j++)
+			putnum(fp, t->pages[j] - (j ? t->pages[j - 1] : 0));
+	}
+	ret = ferror(fp) | fclose(fp);
+	if (ret || rename(tmp, path))
+		unlink(tmp);
+	return ret;
+}
+
+/* load the index saved by idx_save(); it should have npages pages */
+int idx_load(char *path, int n)
+{
+	char s[IDXWORD];
+	unsigned magic, np, cnt, len, m, d;
+	struct term *t;
+	FILE *fp;
+	int i, j, page, ret = 1;
+	if (!(fp = fopen(path, "r")))
+		return 1;
+	if (getnum(fp, &magic) || magic != MAGIC || getnum(fp, &np) ||
+			np != n || getnum(fp, &cnt) || idx_reset(n))
+		goto out;
+	for (i = 0; i < cnt; i++) {
+		if (getnum(fp, &len) || len >= IDXWORD || fread(s, 1, len, fp) != len)
+			goto out;
+		s[len] = '\0';
+		if (getnum(fp, &m) || !(t = idx_term(s)))
+			goto out;
+		for (j = 0, page = 0; j < m; j++) {
+			if (getnum(fp, &d))
+				goto out;
+			page += d;
+			if (page < 1 || page > n || idx_addpage(t, page))
+				goto out;
+		}
+	}
+	memset(done, 1, n + 1);
+	ret = 0;
+out:
+	fclose(fp);
+	if (ret)
+		idx_reset(n);
+	return ret;
+}
@@ -0,0 +1,13 @@
+/* inverted index of the words of the document (index.c) */
+#define IDXWORD		32	/* the maximum length of indexed words */
+
+int idx_reset(int npages);
+int idx_has(int page);
+void idx_fail(int page);
+int idx_todo(int from);
+void idx_add(int page, struct dword *words, int n);
+int idx_match(int page, char *query);
+int idx_norm(char *dst, char *src);
+int idx_terms(char *query, char (*terms)[IDXWORD], int max);
+int idx_save(char *path);
+int idx_load(char *path, int npages);
@@ -0,0 +1,357 @@
+/* asynchronous doc_draw() on a rendering thread */
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "doc.h"
+#include "job.h"
+#include "trace.h"
+
+#define JOB_QUEUED	0
+#define JOB_RUNNING	1
+#define JOB_DONE	2
+
+#define JOB_PAGE	0	/* doc_draw() */
+#define JOB_TILE	1	/* doc_tile() */
+#define JOB_SIZE	2	/* doc_size() */
+#define JOB_PAGES	3	/* doc_pages() */
+#define JOB_TEXT	4	/* doc_text() */
+#define JOB_DIGEST	5	/* doc_digest() of pages[] */
+
+struct job {
+	struct doc *doc;
+	int kind;		/* JOB_* */
+	int page, zoom, rotate;
+	int row, col;		/* tile position */
+	int prio;		/* jobs with larger prio run first */
+	int state;		/* JOB_* */
+	int cancelled;		/* drop the result when the render returns */
+	int preempted;		/* requeue if the render was stopped */
+	void *buf;		/* the rendered page */
+	int rows, cols;		/* page or tile dimensions */
+	unsigned long long digest;	/* doc_digest() of the rendered page */
+	int *pages;		/* JOB_DIGEST pages */
+	struct job *next;
+};
+
+static struct job *jobs;	/* queued jobs */
+static struct job *running;	/* the job being rendered */
+static pthread_mutex_t jlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jcond = PTHREAD_COND_INITIALIZER;	/* a job was queued */
+static pthread_cond_t jdone = PTHREAD_COND_INITIALIZER;	/* a job finished */
+static pthread_t worker;
+static int jfd = -1;		/* eventfd signalled when a job finishes */
+static int jquit;
+
+/* stop the running job if a job with priority prio is waiting */
+static void job_preempt(int prio)
+{
+	if (running && running->prio < prio && !running->cancelled) {
+		running->preempted = 1;
+		doc_stop(running->doc, 1);
+	}
+}
+
+static void job_del(struct job *job)
+{
+	free(job->pages);
+	free(job);
+}
+
+/* doc_digest() of job->pages[]; done here, the user interface never waits for it */
+static unsigned long long *job_digests(struct job *job)
+{
+	unsigned long long *d = malloc(job->rows * sizeof(d[0]));
+	int i;
+	for (i = 0; d && i < job->rows; i++)
+		d[i] = doc_digest(job->doc, job->pages[i]);
+	return d;
+}
+
+static void *job_worker(void *arg)
+{
+	struct job **j, **best;
+	struct job *job;
+	uint64_t one = 1;
+	long long beg;
+	void *buf;
+	pthread_mutex_lock(&jlock);
+	while (!jquit) {
+		if (!jobs) {
+			pthread_cond_wait(&jcond, &jlock);
+			continue;
+		}
+		best = &jobs;
+		for (j = &jobs; *j; j = &(*j)->next)
+			if ((*j)->prio > (*best)->prio)
+				best = j;
+		job = *best;
+		*best = job->next;
+		job->state = JOB_RUNNING;
+		running = job;
+		doc_stop(job->doc, 0);
+		pthread_mutex_unlock(&jlock);
+		buf = NULL;
+		beg = trace_now();
+		if (job->kind == JOB_PAGE) {
+			buf = doc_draw(job->doc, job->page, job->zoom, job->rotate,
+					&job->rows, &job->cols);
+			/* the digest of what was drawn, not of a later version */
+			if (buf)
+				job->digest = doc_digest(job->doc, job->page);
+			trace_add(TR_RENDER, job->page, beg);
+		}
+		if (job->kind == JOB_TILE) {
+			buf = doc_tile(job->doc, job->page, job->zoom, job->rotate,
+					job->row, job->col, job->rows, job->cols);
+			trace_add(TR_TILE, job->page, beg);
+		}
+		if (job->kind == JOB_SIZE && doc_size(job->doc, job->page,
+				job->zoom, job->rotate, &job->rows, &job->cols))
+			job->rows = job->cols = 0;
+		if (job->kind == JOB_PAGES)
+			job->rows = doc_pages(job->doc);
+		if (job->kind == JOB_TEXT) {
+			buf = doc_text(job->doc, job->page, job->zoom, job->rotate,
+					&job->rows);
+			trace_add(TR_TEXT, job->page, beg);
+		}
+		if (job->kind == JOB_DIGEST)
+			buf = job_digests(job);
+		pthread_mutex_lock(&jlock);
+		running = NULL;
+		if (job->cancelled) {
+			free(buf);
+			job_del(job);
+			pthread_cond_broadcast(&jdone);
+			continue;
+		}
+		if (!buf && job->preempted && (job->kind == JOB_PAGE ||
+				job->kind == JOB_TILE || job->kind == JOB_TEXT)) {
+			job->preempted = 0;
+			job->state = JOB_QUEUED;
+			job->next = jobs;
+			jobs = job;
+			continue;
+		}
+		job->buf = buf;
+		job->state = JOB_DONE;
+		pthread_cond_broadcast(&jdone);
+		write(jfd, &one, sizeof(one));
+	}
+	pthread_mutex_unlock(&jlock);
+	return NULL;
+}
+
+int job_init(void)
+{
+	if ((jfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		return 1;
+	jquit = 0;
+	if (pthread_create(&worker, NULL, job_worker, NULL)) {
+		close(jfd);
+		return 1;
+	}
+	return 0;
+}
+
+/* stop the rendering thread; finished jobs are left to their owners */
+void job_free(void)
+{
+	struct job *job;
+	pthread_mutex_lock(&jlock);
+	jquit = 1;
+	while ((job = jobs)) {
+		jobs = job->next;
+		job_del(job);
+	}
+	if (running) {
+		running->cancelled = 1;
+		doc_stop(running->doc, 1);
+	}
+	pthread_cond_signal(&jcond);
+	pthread_mutex_unlock(&jlock);
+	pthread_join(worker, NULL);
+	close(jfd);
+}
+
+/* drop the queued jobs and wait for the running one to stop */
+void job_flush(void)
+{
+	struct job *job;
+	pthread_mutex_lock(&jlock);
+	while ((job = jobs)) {
+		jobs = job->next;
+		job_del(job);
+	}
+	if (running) {
+		running->cancelled = 1;
+		doc_stop(running->doc, 1);
+	}
+	while (running)
+		pthread_cond_wait(&jdone, &jlock);
+	pthread_mutex_unlock(&jlock);
+}
+
+/* readable whenever a job finishes */
+int job_fd(void)
+{
+	return jfd;
+}
+
+static struct job *job_queue(struct job *job)
+{
+	struct job **j;
+	pthread_mutex_lock(&jlock);
+	for (j = &jobs; *j; j = &(*j)->next)
+		;
+	*j = job;
+	job_preempt(job->prio);
+	pthread_cond_signal(&jcond);
+	pthread_mutex_unlock(&jlock);
+	return job;
+}
+
+static struct job *job_new(int kind, struct doc *doc, int page, int zoom, int rotate, int prio)
+{
+	struct job *job = calloc(1, sizeof(*job));
+	if (!job)
+		return NULL;
+	job->kind = kind;
+	job->doc = doc;
+	job->page = page;
+	job->zoom = zoom;
+	job->rotate = rotate;
+	job->prio = prio;
+	return job;
+}
+
+/* queue rendering a page; the job must be passed to job_take() or job_cancel() */
+struct job *job_start(struct doc *doc, int page, int zoom, int rotate, int prio)
+{
+	struct job *job = job_new(JOB_PAGE, doc, page, zoom, rotate, prio);
+	return job ? job_queue(job) : NULL;
+}
+
+/* like job_start() but for a part of the page */
+struct job *job_tile(struct doc *doc, int page, int zoom, int rotate,
+		int row, int col, int rows, int cols, int prio)
+{
+	struct job *job = job_new(JOB_TILE, doc, page, zoom, rotate, prio);
+	if (!job)
+		return NULL;
+	job->row = row;
+	job->col = col;
+	job->rows = rows;
+	job->cols = cols;
+	return job_queue(job);
+}
+
+/* measure a page; job_take() returns NULL and the page dimensions */
+struct job *job_size(struct doc *doc, int page, int zoom, int rotate, int prio)
+{
+	struct job *job = job_new(JOB_SIZE, doc, page, zoom, rotate, prio);
+	return job ? job_queue(job) : NULL;
+}
+
+/* count the pages; job_take() returns NULL and the count in rows */
+struct job *job_pages(struct doc *doc, int prio)
+{
+	struct job *job = job_new(JOB_PAGES, doc, 0, 0, 0, prio);
+	return job ? job_queue(job) : NULL;
+}
+
+/* compute doc_digest() of n pages; job_take() returns the digests and n in rows */
+struct job *job_digest(struct doc *doc, int *pages, int n, int prio)
+{
+	struct job *job = job_new(JOB_DIGEST, doc, 0, 0, 0, prio);
+	if (!job)
+		return NULL;
+	if (!(job->pages = malloc(n * sizeof(pages[0])))) {
+		free(job);
+		return NULL;
+	}
+	memcpy(job->pages, pages, n * sizeof(pages[0]));
+	job->rows = n;
+	return job_queue(job);
+}
+
+/* extract the text of a page; job_take() returns the words (NULL on failure) and their count in rows */
+struct job *job_text(struct doc *doc, int page, int zoom, int rotate, int prio)
+{
+	struct job *job = job_new(JOB_TEXT, doc, page, zoom, rotate, prio);
+	return job ? job_queue(job) : NULL;
+}
+
+void job_prio(struct job *job, int prio)
+{
+	pthread_mutex_lock(&jlock);
+	job->prio = prio;
+	if (job->state == JOB_QUEUED)
+		job_preempt(prio);
+	pthread_mutex_unlock(&jlock);
+}
+
+void job_cancel(struct job *job)
+{
+	struct job **j;
+	if (!job)
+		return;
+	pthread_mutex_lock(&jlock);
+	if (job->state == JOB_QUEUED) {
+		for (j = &jobs; *j && *j != job; j = &(*j)->next)
+			;
+		if (*j)
+			*j = job->next;
+		job_del(job);
+	} else if (job->state == JOB_RUNNING) {
+		job->cancelled = 1;
+		doc_stop(job->doc, 1);
+	} else {
+		free(job->buf);
+		job_del(job);
+	}
+	pthread_mutex_unlock(&jlock);
+}
+
+int job_done(struct job *job)
+{
+	int done;
+	pthread_mutex_lock(&jlock);
+	done = job->state == JOB_DONE;
+	pthread_mutex_unlock(&jlock);
+	return done;
+}
+
+/* doc_digest() of the page drawn by a finished job_start(); before job_take() */
+unsigned long long job_pagedigest(struct job *job)
+{
+	unsigned long long digest;
+	pthread_mutex_lock(&jlock);
+	digest = job->state == JOB_DONE ? job->digest : 0;
+	pthread_mutex_unlock(&jlock);
+	return digest;
+}
+
+/* wait for a job and return its page (NULL on failure); job is freed */
+void *job_take(struct job *job, int *rows, int *cols)
+{
+	void *buf;
+	/* job_new() failed */
+	if (!job) {
+		*rows = 0;
+		*cols = 0;
+		return NULL;
+	}
+	pthread_mutex_lock(&jlock);
+	while (job->state != JOB_DONE)
+		pthread_cond_wait(&jdone, &jlock);
+	buf = job->buf;
+	*rows = job->rows;
+	*cols = job->cols;
+	pthread_mutex_unlock(&jlock);
+	job_del(job);
+	return buf;
+}
@@ -0,0 +1,20 @@
+/* asynchronous rendering on a single thread (job.c) */
+struct doc;
+struct job;
+
+int job_init(void);
+void job_free(void);
+void job_flush(void);
+int job_fd(void);
+struct job *job_start(struct doc *doc, int page, int zoom, int rotate, int prio);
+struct job *job_tile(struct doc *doc, int page, int zoom, int rotate,
+		int row, int col, int rows, int cols, int prio);
+struct job *job_size(struct doc *doc, int page, int zoom, int rotate, int prio);
+struct job *job_pages(struct doc *doc, int prio);
+struct job *job_text(struct doc *doc, int page, int zoom, int rotate, int prio);
+struct job *job_digest(struct doc *doc, int *pages, int n, int prio);
+void job_prio(struct job *job, int prio);
+void job_cancel(struct job *job);
+int job_done(struct job *job);
+void *job_take(struct job *job, int *rows, int *cols);
+unsigned long long job_pagedigest(struct job *job);
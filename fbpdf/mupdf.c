@@ -1,67 +1,684 @@
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include "mupdf/fitz.h"
+#include "mupdf/pdf.h"
 #include "draw.h"
 #include "doc.h"
+#include "fload.h"
+#include "trace.h"
 
+#define LEN(a)		(sizeof(a) / sizeof((a)[0]))
 #define MIN_(a, b)	((a) < (b) ? (a) : (b))
+#define MAX_(a, b)	((a) > (b) ? (a) : (b))
+#define NTHREADS	16	/* maximum number of rendering threads */
+#define BANDMIN		32	/* minimum band height */
+#define ALLOCHDR	16	/* room for the size of mupdf allocations */
+
+static int nthreads;		/* doc_threads() argument; 0 for one per core */
+static long dlimit = 32 << 20;	/* doc_cache() argument */
+static int gray;		/* doc_gray() argument */
+static __thread long allocd;	/* bytes allocated by mupdf in this thread */
+
+/* a cached display list */
+struct dlist {
+	int page;
+	fz_display_list *list;
+	long size;		/* bytes allocated while recording it */
+	struct dlist *next;
+};
+
+/* a page being rasterized in horizontal bands */
+struct bands {
+	fz_display_list *list;
+	fz_matrix ctm;
+	fz_irect bbox;		/* the area to render */
+	int band;		/* band height */
+	int next;		/* the first row of the next band to render */
+	int failed;		/* rendering a band failed */
+	char *pbuf;		/* destination */
+	int bpp;		/* bytes per pixel of pbuf */
+	int fmt;		/* fb_fmt() or FBFMT_GRAY8 */
+	fz_cookie *cookie;
+};
 
 struct doc {
 	fz_context *ctx;
 	fz_document *pdf;
+	void *data;		/* fload() of the file, if any */
+	long datalen;
+	pthread_mutex_t lock;	/* protects stop and cookie */
+	int stop;		/* doc_stop() argument */
+	fz_cookie *cookie;	/* the cookie of the doc_draw() in progress */
+	pthread_mutex_t fzlock[FZ_LOCK_MAX];	/* for fz_locks_context */
+	fz_locks_context locks;
+	pthread_t threads[NTHREADS];	/* band renderers */
+	int nthreads;
+	pthread_mutex_t blk;	/* protects the fields below */
+	pthread_cond_t bcond;	/* new bands to render */
+	pthread_cond_t bdone;	/* a thread finished its bands */
+	struct bands *bands;	/* the page being rendered */
+	int bgen;		/* incremented for each page */
+	int busy;		/* threads rendering bands */
+	int quit;		/* stop the threads */
+	struct dlist *dl;	/* display lists; the most recently used first */
+	struct dstat dstat;	/* protected by lock */
 };
 
-void *doc_draw(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
+/* mupdf allocator; counts allocated bytes to measure display lists */
+static void *mupdf_malloc(void *user, size_t size)
 {
-	fz_matrix ctm;
-	fz_pixmap *pix;
-	fbval_t *pbuf;
-	int x, y;
-	ctm = fz_scale((float) zoom / 100, (float) zoom / 100);
-	ctm = fz_pre_rotate(ctm, rotate);
-	pix = fz_new_pixmap_from_page_number(doc->ctx, doc->pdf,
-			p - 1, ctm, fz_device_rgb(doc->ctx), 0);
-	if (!pix)
+	char *p = malloc(size + ALLOCHDR);
+	if (!p)
 		return NULL;
-	if (!(pbuf = malloc(pix->w * pix->h * sizeof(pbuf[0])))) {
-		fz_drop_pixmap(doc->ctx, pix);
+	*(size_t *) p = size;
+	allocd += size;
+	return p + ALLOCHDR;
+}
+
+static void *mupdf_realloc(void *user, void *old, size_t size)
+{
+	char *p = old ? (char *) old - ALLOCHDR : NULL;
+	size_t osize = p ? *(size_t *) p : 0;
+	if (!(p = realloc(p, size + ALLOCHDR)))
 		return NULL;
+	*(size_t *) p = size;
+	allocd += size - osize;
+	return p + ALLOCHDR;
+}
+
+static void mupdf_free(void *user, void *ptr)
+{
+	if (ptr) {
+		allocd -= *(size_t *) ((char *) ptr - ALLOCHDR);
+		free((char *) ptr - ALLOCHDR);
 	}
-	for (y = 0; y < pix->h; y++) {
-		unsigned char *s = &pix->samples[y * pix->stride];
-		for (x = 0; x < pix->w; x++)
-			pbuf[y * pix->w + x] = FB_VAL(s[x * pix->n + 0],
-					s[x * pix->n + 1], s[x * pix->n + 2]);
+}
+
+static fz_alloc_context mupdf_alloc = {NULL, mupdf_malloc, mupdf_realloc, mupdf_free};
+
+static void mupdf_lock(void *user, int lock)
+{
+	struct doc *doc = user;
+	pthread_mutex_lock(&doc->fzlock[lock]);
+}
+
+static void mupdf_unlock(void *user, int lock)
+{
+	struct doc *doc = user;
+	pthread_mutex_unlock(&doc->fzlock[lock]);
+}
+
+/* render bands of b until none is left */
+static void mupdf_bands(struct doc *doc, fz_context *ctx, struct bands *b)
+{
+	fz_pixmap *pix = NULL;
+	fz_device *dev = NULL;
+	fz_irect rect;
+	int w = b->bbox.x1 - b->bbox.x0;
+	int y;
+	fz_var(pix);
+	fz_var(dev);
+	while (1) {
+		pthread_mutex_lock(&doc->blk);
+		rect = b->bbox;
+		rect.y0 += b->next;
+		b->next += b->band;
+		pthread_mutex_unlock(&doc->blk);
+		if (rect.y0 >= rect.y1 || b->cookie->abort)
+			break;
+		rect.y1 = MIN_(rect.y1, rect.y0 + b->band);
+		fz_try (ctx) {
+			/* draw directly into pbuf if mupdf can produce fb pixels */
+			if (b->fmt)
+				pix = fz_new_pixmap_with_bbox_and_data(ctx,
+					b->fmt == FBFMT_GRAY8 ? fz_device_gray(ctx) :
+					(b->fmt == FBFMT_BGRX32 ? fz_device_bgr(ctx) : fz_device_rgb(ctx)),
+					rect, NULL, b->bpp == 4, (unsigned char *)
+					(b->pbuf + (rect.y0 - b->bbox.y0) * w * b->bpp));
+			else
+				pix = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), rect, NULL, 0);
+			fz_clear_pixmap_with_value(ctx, pix, 0xff);
+			dev = fz_new_draw_device(ctx, fz_identity, pix);
+			fz_run_display_list(ctx, b->list, dev, b->ctm,
+				fz_rect_from_irect(rect), b->cookie);
+			fz_close_device(ctx, dev);
+			if (!b->fmt) {
+				long long beg = trace_now();
+				for (y = rect.y0; y < rect.y1; y++)
+					fb_conv(b->pbuf + (y - b->bbox.y0) * w * b->bpp,
+						pix->samples + (y - rect.y0) * pix->stride,
+						w, FBFMT_RGB24);
+				trace_add(TR_CONV, rect.y1 - rect.y0, beg);
+			}
+		} fz_always (ctx) {
+			fz_drop_device(ctx, dev);
+			fz_drop_pixmap(ctx, pix);
+			dev = NULL;
+			pix = NULL;
+		} fz_catch (ctx) {
+			pthread_mutex_lock(&doc->blk);
+			b->failed = 1;
+			pthread_mutex_unlock(&doc->blk);
+		}
+	}
+}
+
+static void *mupdf_thread(void *arg)
+{
+	struct doc *doc = arg;
+	fz_context *ctx = fz_clone_context(doc->ctx);
+	struct bands *b;
+	int gen = 0;
+	pthread_mutex_lock(&doc->blk);
+	while (!doc->quit) {
+		if (!ctx || !doc->bands || doc->bgen == gen) {
+			pthread_cond_wait(&doc->bcond, &doc->blk);
+			continue;
+		}
+		gen = doc->bgen;
+		b = doc->bands;
+		doc->busy++;
+		pthread_mutex_unlock(&doc->blk);
+		mupdf_bands(doc, ctx, b);
+		pthread_mutex_lock(&doc->blk);
+		if (!--doc->busy)
+			pthread_cond_broadcast(&doc->bdone);
+	}
+	pthread_mutex_unlock(&doc->blk);
+	fz_drop_context(ctx);
+	return NULL;
+}
+
+/* render b on this and the band threads */
+static int mupdf_raster(struct doc *doc, struct bands *b)
+{
+	int h = b->bbox.y1 - b->bbox.y0;
+	b->band = MAX_(BANDMIN, (h + 2 * doc->nthreads) / (2 * doc->nthreads + 1));
+	pthread_mutex_lock(&doc->blk);
+	doc->bands = b;
+	doc->bgen++;
+	pthread_cond_broadcast(&doc->bcond);
+	pthread_mutex_unlock(&doc->blk);
+	mupdf_bands(doc, doc->ctx, b);
+	pthread_mutex_lock(&doc->blk);
+	while (doc->busy)
+		pthread_cond_wait(&doc->bdone, &doc->blk);
+	doc->bands = NULL;
+	pthread_mutex_unlock(&doc->blk);
+	return b->failed || b->cookie->abort;
+}
+
+/* drop the least recently used display lists beyond the limit */
+static void mupdf_shrink(struct doc *doc)
+{
+	struct dlist **d = &doc->dl;
+	long size = 0;
+	while (*d) {
+		size += (*d)->size;
+		/* keep the most recent list even if it is too large */
+		if (size > dlimit && *d != doc->dl) {
+			struct dlist *old = *d;
+			size -= old->size;
+			*d = old->next;
+			fz_drop_display_list(doc->ctx, old->list);
+			free(old);
+		} else {
+			d = &(*d)->next;
+		}
+	}
+	pthread_mutex_lock(&doc->lock);
+	doc->dstat.size = size;
+	pthread_mutex_unlock(&doc->lock);
+}
+
+/*
+ * The display list of page p; the caller drops the reference.  It is
+ * recorded with cookie, and is kept for later calls if keep is nonzero.
+ */
+static fz_display_list *mupdf_list(struct doc *doc, int p, fz_cookie *cookie, int keep)
+{
+	fz_context *ctx = doc->ctx;
+	fz_display_list *list = NULL;
+	fz_device *dev = NULL;
+	fz_page *page = NULL;
+	struct dlist **d;
+	struct dlist *dl;
+	long size;
+	for (d = &doc->dl; *d && (*d)->page != p; d = &(*d)->next)
+		;
+	if ((dl = *d)) {
+		if (keep) {
+			*d = dl->next;
+			dl->next = doc->dl;
+			doc->dl = dl;
+		}
+		pthread_mutex_lock(&doc->lock);
+		doc->dstat.hits++;
+		pthread_mutex_unlock(&doc->lock);
+		return fz_keep_display_list(ctx, dl->list);
+	}
+	pthread_mutex_lock(&doc->lock);
+	doc->dstat.misses++;
+	pthread_mutex_unlock(&doc->lock);
+	fz_var(page);
+	fz_var(dev);
+	fz_var(list);
+	fz_try (ctx) {
+		size = allocd;
+		page = fz_load_page(ctx, doc->pdf, p - 1);
+		list = fz_new_display_list(ctx, fz_bound_page(ctx, page));
+		dev = fz_new_list_device(ctx, list);
+		fz_run_page(ctx, page, dev, fz_identity, cookie);
+		fz_close_device(ctx, dev);
+		fz_drop_device(ctx, dev);
+		dev = NULL;
+		fz_drop_page(ctx, page);
+		page = NULL;
+		size = allocd - size;
+		/* the list of a stopped page is incomplete */
+		if (cookie && cookie->abort)
+			fz_throw(ctx, FZ_ERROR_ABORT, "stopped");
+	} fz_catch (ctx) {
+		fz_drop_device(ctx, dev);
+		fz_drop_page(ctx, page);
+		fz_drop_display_list(ctx, list);
+		fz_rethrow(ctx);
+	}
+	if (keep && dlimit > 0 && (dl = calloc(1, sizeof(*dl)))) {
+		dl->page = p;
+		dl->list = fz_keep_display_list(ctx, list);
+		dl->size = size > 0 ? size : 0;
+		dl->next = doc->dl;
+		doc->dl = dl;
+		mupdf_shrink(doc);
+	}
+	return list;
+}
+
+static fz_matrix mupdf_ctm(int zoom, int rotate)
+{
+	fz_matrix ctm = fz_scale((float) zoom / 100, (float) zoom / 100);
+	return fz_pre_rotate(ctm, rotate);
+}
+
+/* render the whole page or, if tile is not NULL, its part at tile */
+static void *mupdf_draw(struct doc *doc, int p, int zoom, int rotate,
+		fz_irect *tile, int *rows, int *cols)
+{
+	fz_context *ctx = doc->ctx;
+	fz_irect bbox;
+	fz_display_list *list = NULL;
+	fz_cookie cookie = {0};
+	struct bands b = {0};
+	char *pbuf = NULL;
+	int w, h;
+	pthread_mutex_lock(&doc->lock);
+	cookie.abort = doc->stop;
+	doc->cookie = &cookie;
+	pthread_mutex_unlock(&doc->lock);
+	b.ctm = mupdf_ctm(zoom, rotate);
+	fz_var(list);
+	fz_var(pbuf);
+	fz_try (ctx) {
+		if (cookie.abort)
+			fz_throw(ctx, FZ_ERROR_ABORT, "stopped");
+		list = mupdf_list(doc, p, &cookie, 1);
+		bbox = fz_round_rect(fz_transform_rect(fz_bound_display_list(ctx, list), b.ctm));
+		if (tile) {
+			bbox.x1 = MIN_(bbox.x1, bbox.x0 + tile->x1);
+			bbox.y1 = MIN_(bbox.y1, bbox.y0 + tile->y1);
+			bbox.x0 += tile->x0;
+			bbox.y0 += tile->y0;
+			if (bbox.x1 <= bbox.x0 || bbox.y1 <= bbox.y0)
+				fz_throw(ctx, FZ_ERROR_GENERIC, "empty tile");
+		}
+		w = bbox.x1 - bbox.x0;
+		h = bbox.y1 - bbox.y0;
+		b.bpp = gray ? 1 : FBM_BPP(fb_mode());
+		if (!(pbuf = malloc(w * h * b.bpp)))
+			fz_throw(ctx, FZ_ERROR_MEMORY, "cannot allocate page");
+		b.list = list;
+		b.bbox = bbox;
+		b.pbuf = pbuf;
+		b.fmt = gray ? FBFMT_GRAY8 : fb_fmt();
+		b.cookie = &cookie;
+		if (mupdf_raster(doc, &b))
+			fz_throw(ctx, FZ_ERROR_ABORT, "stopped");
+		*cols = w;
+		*rows = h;
+	} fz_always (ctx) {
+		fz_drop_display_list(ctx, list);
+		pthread_mutex_lock(&doc->lock);
+		doc->cookie = NULL;
+		pthread_mutex_unlock(&doc->lock);
+	} fz_catch (ctx) {
+		free(pbuf);
+		pbuf = NULL;
 	}
-	fz_drop_pixmap(doc->ctx, pix);
-	*cols = pix->w;
-	*rows = pix->h;
 	return pbuf;
 }
 
+void *doc_draw(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
+{
+	return mupdf_draw(doc, p, zoom, rotate, NULL, rows, cols);
+}
+
+void *doc_tile(struct doc *doc, int p, int zoom, int rotate,
+		int row, int col, int rows, int cols)
+{
+	fz_irect tile = {col, row, col + cols, row + rows};
+	int h, w;
+	return mupdf_draw(doc, p, zoom, rotate, &tile, &h, &w);
+}
+
+int doc_size(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
+{
+	fz_context *ctx = doc->ctx;
+	fz_display_list *list = NULL;
+	fz_irect bbox;
+	int ret = 0;
+	fz_var(list);
+	fz_try (ctx) {
+		/* the list is needed for rendering the page anyway */
+		list = mupdf_list(doc, p, NULL, 1);
+		bbox = fz_round_rect(fz_transform_rect(fz_bound_display_list(ctx, list),
+				mupdf_ctm(zoom, rotate)));
+		*cols = bbox.x1 - bbox.x0;
+		*rows = bbox.y1 - bbox.y0;
+	} fz_always (ctx) {
+		fz_drop_display_list(ctx, list);
+	} fz_catch (ctx) {
+		ret = 1;
+	}
+	return ret;
+}
+
+/* append the words of a line of text to words */
+static int mupdf_line(fz_stext_line *line, fz_matrix ctm, fz_irect bbox,
+		struct dword **words, int n)
+{
+	fz_stext_char *ch;
+	fz_rect r = {0}, cr;
+	char s[64];
+	float box[4];
+	int len = 0;
+	for (ch = line->first_char; ; ch = ch->next) {
+		if ((!ch || ch->c <= ' ') && len) {
+			r = fz_transform_rect(r, ctm);
+			box[0] = r.x0 - bbox.x0;
+			box[1] = r.y0 - bbox.y0;
+			box[2] = r.x1 - bbox.x0;
+			box[3] = r.y1 - bbox.y0;
+			if (doc_word(words, n, s, len, box, 0, 0, 0, 1))
+				return n;
+			n++;
+			len = 0;
+		}
+		if (!ch)
+			break;
+		if (ch->c <= ' ' || len + FZ_UTFMAX > sizeof(s))
+			continue;
+		cr = fz_rect_from_quad(ch->quad);
+		if (!len)
+			r = cr;
+		r.x0 = MIN_(r.x0, cr.x0);
+		r.y0 = MIN_(r.y0, cr.y0);
+		r.x1 = MAX_(r.x1, cr.x1);
+		r.y1 = MAX_(r.y1, cr.y1);
+		len += fz_runetochar(s + len, ch->c);
+	}
+	return n;
+}
+
+struct dword *doc_text(struct doc *doc, int p, int zoom, int rotate, int *n)
+{
+	fz_context *ctx = doc->ctx;
+	fz_display_list *list = NULL;
+	fz_stext_page *text = NULL;
+	fz_device *dev = NULL;
+	fz_cookie cookie = {0};
+	fz_stext_block *block;
+	fz_stext_line *line;
+	fz_matrix ctm = mupdf_ctm(zoom, rotate);
+	fz_rect bounds;
+	fz_irect bbox;
+	struct dword *words = NULL;
+	*n = 0;
+	pthread_mutex_lock(&doc->lock);
+	cookie.abort = doc->stop;
+	doc->cookie = &cookie;
+	pthread_mutex_unlock(&doc->lock);
+	fz_var(list);
+	fz_var(text);
+	fz_var(dev);
+	fz_var(words);
+	fz_try (ctx) {
+		if (cookie.abort)
+			fz_throw(ctx, FZ_ERROR_ABORT, "stopped");
+		/* the list of a page being read is likely cached; indexing keeps none */
+		list = mupdf_list(doc, p, &cookie, 0);
+		bounds = fz_bound_display_list(ctx, list);
+		bbox = fz_round_rect(fz_transform_rect(bounds, ctm));
+		text = fz_new_stext_page(ctx, bounds);
+		dev = fz_new_stext_device(ctx, text, NULL);
+		fz_run_display_list(ctx, list, dev, fz_identity, fz_infinite_rect, &cookie);
+		fz_close_device(ctx, dev);
+		if (cookie.abort)
+			fz_throw(ctx, FZ_ERROR_ABORT, "stopped");
+		for (block = text->first_block; block; block = block->next)
+			if (block->type == FZ_STEXT_BLOCK_TEXT)
+				for (line = block->u.t.first_line; line; line = line->next)
+					*n = mupdf_line(line, ctm, bbox, &words, *n);
+		if (!words && !(words = malloc(sizeof(*words))))
+			fz_throw(ctx, FZ_ERROR_MEMORY, "cannot allocate words");
+	} fz_always (ctx) {
+		fz_drop_device(ctx, dev);
+		fz_drop_stext_page(ctx, text);
+		fz_drop_display_list(ctx, list);
+		pthread_mutex_lock(&doc->lock);
+		doc->cookie = NULL;
+		pthread_mutex_unlock(&doc->lock);
+	} fz_catch (ctx) {
+		free(words);
+		words = NULL;
+		*n = 0;
+	}
+	return words;
+}
+
+void doc_stop(struct doc *doc, int stop)
+{
+	pthread_mutex_lock(&doc->lock);
+	doc->stop = stop;
+	if (stop && doc->cookie)
+		doc->cookie->abort = 1;
+	pthread_mutex_unlock(&doc->lock);
+}
+
 int doc_pages(struct doc *doc)
 {
 	return fz_count_pages(doc->ctx, doc->pdf);
 }
 
+static unsigned long long mupdf_fnv(unsigned long long h, const void *s, long n)
+{
+	const unsigned char *b = s;
+	long i;
+	for (i = 0; i < n; i++)
+		h = (h ^ b[i]) * 0x100000001b3ull;
+	return h;
+}
+
+/* fold obj and the objects it refers to into h; object numbers are ignored */
+static unsigned long long mupdf_hash(fz_context *ctx, pdf_obj *obj, unsigned long long h)
+{
+	/* references to other pages and to things not drawn */
+	static char *skip[] = {"Parent", "P", "A", "Dest", "StructParents"};
+	fz_buffer *buf = NULL;
+	unsigned char *data;
+	float f;
+	int i, j, n;
+	if (pdf_is_name(ctx, obj))
+		return mupdf_fnv(h, pdf_to_name(ctx, obj), strlen(pdf_to_name(ctx, obj)) + 1);
+	if (pdf_is_string(ctx, obj))
+		return mupdf_fnv(h, pdf_to_str_buf(ctx, obj), pdf_to_str_len(ctx, obj));
+	if (pdf_is_number(ctx, obj)) {
+		f = pdf_to_real(ctx, obj);
+		return mupdf_fnv(h, &f, sizeof(f));
+	}
+	if (pdf_is_bool(ctx, obj))
+		return mupdf_fnv(h, pdf_to_bool(ctx, obj) ? "t" : "f", 1);
+	if (!pdf_is_dict(ctx, obj) && !pdf_is_array(ctx, obj))
+		return mupdf_fnv(h, "n", 1);
+	/* cycles */
+	if (pdf_mark_obj(ctx, obj))
+		return mupdf_fnv(h, "@", 1);
+	fz_var(buf);
+	fz_try (ctx) {
+		if (pdf_is_array(ctx, obj)) {
+			n = pdf_array_len(ctx, obj);
+			for (i = 0; i < n; i++)
+				h = mupdf_hash(ctx, pdf_array_get(ctx, obj, i), h);
+		} else {
+			n = pdf_dict_len(ctx, obj);
+			for (i = 0; i < n; i++) {
+				pdf_obj *key = pdf_dict_get_key(ctx, obj, i);
+				for (j = 0; j < LEN(skip); j++)
+					if (!strcmp(pdf_to_name(ctx, key), skip[j]))
+						break;
+				if (j < LEN(skip))
+					continue;
+				h = mupdf_hash(ctx, key, h);
+				h = mupdf_hash(ctx, pdf_dict_get_val(ctx, obj, i), h);
+			}
+		}
+		/* the encoded data suffices */
+		if (pdf_is_stream(ctx, obj)) {
+			buf = pdf_load_raw_stream(ctx, obj);
+			n = fz_buffer_storage(ctx, buf, &data);
+			h = mupdf_fnv(h, data, n);
+		}
+	} fz_always (ctx) {
+		fz_drop_buffer(ctx, buf);
+		pdf_unmark_obj(ctx, obj);
+	} fz_catch (ctx) {
+		fz_rethrow(ctx);
+	}
+	return h;
+}
+
+/* hash the page object of pdf files, with its contents and resources */
+unsigned long long doc_digest(struct doc *doc, int p)
+{
+	pdf_obj *inherited[] = {PDF_NAME(Resources), PDF_NAME(MediaBox),
+		PDF_NAME(CropBox), PDF_NAME(Rotate)};
+	fz_context *ctx = doc->ctx;
+	pdf_document *pdf = pdf_specifics(ctx, doc->pdf);
+	unsigned long long h = 0xcbf29ce484222325ull;
+	pdf_obj *page;
+	int i;
+	if (!pdf)
+		return 0;
+	fz_try (ctx) {
+		page = pdf_lookup_page_obj(ctx, pdf, p - 1);
+		h = mupdf_hash(ctx, page, h);
+		for (i = 0; i < LEN(inherited); i++)
+			h = mupdf_hash(ctx, pdf_dict_get_inheritable(ctx, page, inherited[i]), h);
+	} fz_catch (ctx) {
+		return 0;
+	}
+	return h ? h : 1;
+}
+
+void doc_threads(int n)
+{
+	nthreads = n;
+}
+
+void doc_cache(long size)
+{
+	dlimit = size;
+}
+
+void doc_gray(int on)
+{
+	gray = on;
+}
+
+int doc_stat(struct doc *doc, struct dstat *st)
+{
+	pthread_mutex_lock(&doc->lock);
+	*st = doc->dstat;
+	pthread_mutex_unlock(&doc->lock);
+	st->limit = dlimit;
+	return 0;
+}
+
 struct doc *doc_open(char *path)
 {
-	struct doc *doc = malloc(sizeof(*doc));
-	doc->ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+	struct doc *doc = calloc(1, sizeof(*doc));
+	int n = nthreads > 0 ? nthreads : sysconf(_SC_NPROCESSORS_ONLN);
+	fz_stream *stm = NULL;
+	int i;
+	pthread_mutex_init(&doc->lock, NULL);
+	pthread_mutex_init(&doc->blk, NULL);
+	pthread_cond_init(&doc->bcond, NULL);
+	pthread_cond_init(&doc->bdone, NULL);
+	for (i = 0; i < FZ_LOCK_MAX; i++)
+		pthread_mutex_init(&doc->fzlock[i], NULL);
+	doc->locks.user = doc;
+	doc->locks.lock = mupdf_lock;
+	doc->locks.unlock = mupdf_unlock;
+	doc->ctx = fz_new_context(&mupdf_alloc, &doc->locks, FZ_STORE_DEFAULT);
+	if (!doc->ctx) {
+		free(doc);
+		return NULL;
+	}
 	fz_register_document_handlers(doc->ctx);
+	doc->data = fload(path, &doc->datalen);
+	fz_var(stm);
 	fz_try (doc->ctx) {
-		doc->pdf = fz_open_document(doc->ctx, path);
+		if (doc->data) {
+			/* the path tells mupdf the document type */
+			stm = fz_open_memory(doc->ctx, doc->data, doc->datalen);
+			doc->pdf = fz_open_document_with_stream(doc->ctx, path, stm);
+		} else {
+			doc->pdf = fz_open_document(doc->ctx, path);
+		}
+	} fz_always (doc->ctx) {
+		fz_drop_stream(doc->ctx, stm);
 	} fz_catch (doc->ctx) {
 		fz_drop_context(doc->ctx);
+		free(doc->data);
 		free(doc);
 		return NULL;
 	}
+	/* the thread calling doc_draw() renders bands too */
+	for (i = 0; i < MIN_(n, NTHREADS + 1) - 1; i++)
+		if (!pthread_create(&doc->threads[doc->nthreads], NULL, mupdf_thread, doc))
+			doc->nthreads++;
 	return doc;
 }
 
 void doc_close(struct doc *doc)
 {
+	struct dlist *dl;
+	int i;
+	pthread_mutex_lock(&doc->blk);
+	doc->quit = 1;
+	pthread_cond_broadcast(&doc->bcond);
+	pthread_mutex_unlock(&doc->blk);
+	for (i = 0; i < doc->nthreads; i++)
+		pthread_join(doc->threads[i], NULL);
+	while ((dl = doc->dl)) {
+		doc->dl = dl->next;
+		fz_drop_display_list(doc->ctx, dl->list);
+		free(dl);
+	}
 	fz_drop_document(doc->ctx, doc->pdf);
 	fz_drop_context(doc->ctx);
+	free(doc->data);
 	free(doc);
 }
@@ -10,10 +10,17 @@
 extern "C" {
 #include "draw.h"
 #include "doc.h"
+#include "fload.h"
+#include "trace.h"
 }
 
+static int gray;		/* doc_gray() argument */
+
 struct doc {
 	poppler::document *doc;
+	void *data;		/* fload() of the file, if any */
+	long datalen;
+	volatile int stop;	/* doc_stop() argument */
 };
 
 static poppler::rotation_enum rotation(int times)
@@ -27,47 +34,160 @@ static poppler::rotation_enum rotation(int times)
 	return poppler::rotate_0;
 }
 
-void *doc_draw(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
+/* render the rectangle at x, y of size w, h; the whole page if w is -1 */
+static void *poppler_draw(struct doc *doc, int p, int zoom, int rotate,
+		int x, int y, int w, int h, int *rows, int *cols)
 {
+	if (doc->stop)
+		return NULL;
 	poppler::page *page = doc->doc->create_page(p - 1);
 	poppler::page_renderer pr;
-	int x, y;
-	int h, w;
-	fbval_t *pbuf;
+	int i;
+	char *pbuf;
 	unsigned char *dat;
+	int fmt = fb_fmt();
+	int bpp = gray ? 1 : FBM_BPP(fb_mode());
+	long long beg;
 	pr.set_render_hint(poppler::page_renderer::antialiasing, true);
 	pr.set_render_hint(poppler::page_renderer::text_antialiasing, true);
+	pr.set_image_format(gray ? poppler::image::format_gray8 : poppler::image::format_argb32);
 	poppler::image img = pr.render_page(page,
 				(float) 72 * zoom / 100, (float) 72 * zoom / 100,
-				-1, -1, -1, -1, rotation((rotate + 89) / 90));
+				x, y, w, h, rotation((rotate + 89) / 90));
+	/* poppler-cpp cannot interrupt render_page() */
+	if (doc->stop || !img.is_valid()) {
+		delete page;
+		return NULL;
+	}
 	h = img.height();
 	w = img.width();
 	dat = (unsigned char *) img.data();
-	if (!(pbuf = (fbval_t *) malloc(h * w * sizeof(pbuf[0])))) {
+	if (!(pbuf = (char *) malloc(h * w * bpp))) {
 		delete page;
 		return NULL;
 	}
-	for (y = 0; y < h; y++) {
-		unsigned char *s = dat + img.bytes_per_row() * y;
-		for (x = 0; x < w; x++)
-			pbuf[y * w + x] = FB_VAL(s[x * 4 + 2],
-					s[x * 4 + 1], s[x * 4 + 0]);
+	/* argb32 images hold native-endian 0xaarrggbb words */
+	beg = trace_now();
+	for (i = 0; i < h; i++) {
+		unsigned char *s = dat + img.bytes_per_row() * i;
+		if (gray || fmt == FBFMT_BGRX32)
+			memcpy(pbuf + i * w * bpp, s, w * bpp);
+		else
+			fb_conv(pbuf + i * w * bpp, s, w, FBFMT_BGRX32);
 	}
+	trace_add(TR_CONV, h, beg);
 	*rows = h;
 	*cols = w;
 	delete page;
 	return pbuf;
 }
 
+void *doc_draw(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
+{
+	return poppler_draw(doc, p, zoom, rotate, -1, -1, -1, -1, rows, cols);
+}
+
+void *doc_tile(struct doc *doc, int p, int zoom, int rotate,
+		int row, int col, int rows, int cols)
+{
+	int h, w;
+	return poppler_draw(doc, p, zoom, rotate, col, row, cols, rows, &h, &w);
+}
+
+int doc_size(struct doc *doc, int p, int zoom, int rotate, int *rows, int *cols)
+{
+	poppler::page *page = doc->doc->create_page(p - 1);
+	if (!page)
+		return 1;
+	poppler::rectf r = page->page_rect();
+	int h = r.height() * zoom / 100;
+	int w = r.width() * zoom / 100;
+	int turns = (rotate + 89) / 90;
+	if (page->orientation() == poppler::landscape ||
+			page->orientation() == poppler::seascape)
+		turns++;
+	*rows = turns & 1 ? w : h;
+	*cols = turns & 1 ? h : w;
+	delete page;
+	return 0;
+}
+
+struct dword *doc_text(struct doc *doc, int p, int zoom, int rotate, int *n)
+{
+	poppler::page *page = doc->doc->create_page(p - 1);
+	struct dword *words = NULL;
+	*n = 0;
+	if (!page)
+		return NULL;
+	poppler::rectf r = page->page_rect();
+	float w = r.width();
+	float h = r.height();
+	/* text boxes are laid out like the page is shown without rotation */
+	if (page->orientation() == poppler::landscape ||
+			page->orientation() == poppler::seascape) {
+		w = r.height();
+		h = r.width();
+	}
+	std::vector<poppler::text_box> boxes = page->text_list();
+	for (size_t i = 0; i < boxes.size(); i++) {
+		poppler::byte_array s = boxes[i].text().to_utf8();
+		poppler::rectf b = boxes[i].bbox();
+		float box[4] = {(float) b.left(), (float) b.top(),
+				(float) b.right(), (float) b.bottom()};
+		if (s.empty() || doc_word(&words, *n, &s[0], s.size(), box,
+				w, h, (rotate + 89) / 90, (float) zoom / 100))
+			continue;
+		(*n)++;
+	}
+	delete page;
+	if (!words)
+		words = (struct dword *) malloc(sizeof(*words));
+	return words;
+}
+
+void doc_stop(struct doc *doc, int stop)
+{
+	doc->stop = stop;
+}
+
+/* rendering is single-threaded */
+void doc_threads(int n)
+{
+}
+
+/* pages are not cached */
+void doc_cache(long size)
+{
+}
+
+void doc_gray(int on)
+{
+	gray = on;
+}
+
+int doc_stat(struct doc *doc, struct dstat *st)
+{
+	return 1;
+}
+
 int doc_pages(struct doc *doc)
 {
 	return doc->doc->pages();
 }
 
+unsigned long long doc_digest(struct doc *doc, int p)
+{
+	return 0;
+}
+
 struct doc *doc_open(char *path)
 {
-	struct doc *doc = (struct doc *) malloc(sizeof(*doc));
-	doc->doc = poppler::document::load_from_file(path);
+	struct doc *doc = (struct doc *) calloc(1, sizeof(*doc));
+	/* poppler reads the copy in place */
+	if ((doc->data = fload(path, &doc->datalen)))
+		doc->doc = poppler::document::load_from_raw_data((char *) doc->data, doc->datalen);
+	else
+		doc->doc = poppler::document::load_from_file(path);
 	if (!doc->doc) {
 		doc_close(doc);
 		return NULL;
@@ -78,5 +198,6 @@ struct doc *doc_open(char *path)
 void doc_close(struct doc *doc)
 {
 	delete doc->doc;
+	free(doc->data);
 	free(doc);
 }
@@ -0,0 +1,110 @@
+/* per-stage timing of the hot paths, kept in a ring buffer */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "trace.h"
+
+#define NTRACE		4096	/* the number of stages remembered */
+
+static struct trace {
+	long long beg, dur;	/* nanoseconds */
+	int stage;
+	int arg;
+	int tid;		/* the thread that recorded it */
+} ring[NTRACE];
+static unsigned long tnext;	/* the number of stages recorded */
+
+static struct {
+	char *name;
+	char *arg;		/* the meaning of trace_add()'s arg */
+} stages[TR_N] = {
+	[TR_LOAD] = {"load", "page"},
+	[TR_CACHE] = {"cache", "page"},
+	[TR_DISK] = {"disk", "page"},
+	[TR_INVERT] = {"invert", "page"},
+	[TR_DRAW] = {"draw", "page"},
+	[TR_FLIP] = {"flip", "page"},
+	[TR_INPUT] = {"input", "events"},
+	[TR_RENDER] = {"render", "page"},
+	[TR_TILE] = {"tile", "page"},
+	[TR_TEXT] = {"text", "page"},
+	[TR_CONV] = {"conv", "rows"},
+};
+
+long long trace_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+static int trace_tid(void)
+{
+	static __thread int tid;
+	if (!tid)
+		tid = syscall(SYS_gettid);
+	return tid;
+}
+
+/* any thread may record; the oldest entries are overwritten */
+void trace_add(int stage, int arg, long long beg)
+{
+	long long now = trace_now();
+	struct trace *t = &ring[__atomic_fetch_add(&tnext, 1, __ATOMIC_RELAXED) % NTRACE];
+	t->beg = beg;
+	t->dur = now - beg;
+	t->stage = stage;
+	t->arg = arg;
+	t->tid = trace_tid();
+}
+
+/* the average and maximum milliseconds of each stage, as in "draw 2.1/8.3" */
+void trace_stats(char *buf, int len)
+{
+	long long sum[TR_N] = {0}, max[TR_N] = {0};
+	int cnt[TR_N] = {0};
+	int n = tnext < NTRACE ? tnext : NTRACE;
+	int i, off = 0;
+	for (i = 0; i < n; i++) {
+		struct trace *t = &ring[i];
+		if (t->stage < 0 || t->stage >= TR_N)
+			continue;
+		cnt[t->stage]++;
+		sum[t->stage] += t->dur;
+		if (t->dur > max[t->stage])
+			max[t->stage] = t->dur;
+	}
+	buf[0] = '\0';
+	for (i = 0; i < TR_N && off < len; i++)
+		if (cnt[i])
+			off += snprintf(buf + off, len - off, "%s%s %.1f/%.1f",
+				off ? "  " : "", stages[i].name,
+				sum[i] / cnt[i] / 1e6, max[i] / 1e6);
+}
+
+int trace_dump(char *path)
+{
+	unsigned long end = tnext;
+	unsigned long i = end > NTRACE ? end - NTRACE : 0;
+	FILE *fp;
+	int first = 1;
+	if (!(fp = fopen(path, "w")))
+		return 1;
+	fprintf(fp, "{\"traceEvents\": [");
+	for (; i < end; i++) {
+		struct trace *t = &ring[i % NTRACE];
+		if (t->stage < 0 || t->stage >= TR_N)
+			continue;
+		fprintf(fp, "%s\n {\"name\": \"%s\", \"cat\": \"fbpdf\", \"ph\": \"X\", "
+			"\"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d, "
+			"\"args\": {\"%s\": %d}}",
+			first ? "" : ",", stages[t->stage].name,
+			t->beg / 1e3, t->dur / 1e3, getpid(), t->tid,
+			stages[t->stage].arg, t->arg);
+		first = 0;
+	}
+	fprintf(fp, "\n], \"displayTimeUnit\": \"ms\"}\n");
+	return fclose(fp) != 0;
+}
@@ -0,0 +1,22 @@
+/* per-stage timing of the hot paths (trace.c) */
+#define TR_LOAD		0	/* loadpage() */
+#define TR_CACHE	1	/* cache_get() of the page */
+#define TR_DISK		2	/* disk_get() of the page */
+#define TR_INVERT	3	/* inverting the colors of a rendered page */
+#define TR_DRAW		4	/* draw(), including fb_flip() */
+#define TR_FLIP		5	/* fb_flip() */
+#define TR_INPUT	6	/* handling a batch of input events */
+#define TR_RENDER	7	/* doc_draw() on the rendering thread */
+#define TR_TILE		8	/* doc_tile() */
+#define TR_TEXT		9	/* doc_text() */
+#define TR_CONV		10	/* converting rendered pixels with fb_conv() */
+#define TR_N		11
+
+/* monotonic time in nanoseconds */
+long long trace_now(void);
+/* record stage, which began at beg and ends now; arg is usually the page */
+void trace_add(int stage, int arg, long long beg);
+/* summarize the recent durations of each stage in buf */
+void trace_stats(char *buf, int len);
+/* write the recorded stages to path in the Chrome trace event format */
+int trace_dump(char *path);
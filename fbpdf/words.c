@@ -0,0 +1,46 @@
+/* helpers for the text layer of the backends */
+#include <stdlib.h>
+#include <string.h>
+#include "doc.h"
+
+/*
+ * Append the word s of length len to words, which holds n words.  box
+ * holds x0, y0, x1 and y1 of the word on a w x h page with the origin
+ * at its top left; the box is turned clockwise turns times and scaled
+ * to doc_draw() pixels.  Returns nonzero if out of memory.
+ */
+int doc_word(struct dword **words, int n, char *s, int len, float *box,
+		float w, float h, int turns, float scale)
+{
+	float x0 = box[0], y0 = box[1], x1 = box[2], y1 = box[3], t;
+	struct dword *d;
+	int full = len;
+	int i;
+	/* the array grows whenever n reaches a power of two */
+	if (!(n & (n - 1)) && !(d = realloc(*words, (n < 16 ? 16 : n * 2) * sizeof(*d))))
+		return 1;
+	if (!(n & (n - 1)))
+		*words = d;
+	for (i = 0; i < (turns & 3); i++) {
+		t = x0;
+		x0 = h - y1;
+		y1 = x1;
+		x1 = h - y0;
+		y0 = t;
+		t = w;
+		w = h;
+		h = t;
+	}
+	d = *words + n;
+	len = len < sizeof(d->s) - 1 ? len : sizeof(d->s) - 1;
+	/* do not cut UTF-8 sequences */
+	while (len > 0 && len < full && (s[len] & 0xc0) == 0x80)
+		len--;
+	memcpy(d->s, s, len);
+	d->s[len] = '\0';
+	d->c0 = x0 * scale;
+	d->r0 = y0 * scale;
+	d->c1 = x1 * scale + 0.5;
+	d->r1 = y1 * scale + 0.5;
+	return 0;
+}